@@ -1089,6 +1089,31 @@ do_page_fault(struct pt_regs *regs, unsigned long error_code)
 		return;
 	}
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	/*
+	 * Try to handle user faults without mmap_sem first. This returns
+	 * VM_FAULT_RETRY when the locked path below has to do the work.
+	 * Kernel faults always go the locked way, so that a fault from
+	 * outside the exception tables is caught below and oopses.
+	 */
+	fault = VM_FAULT_RETRY;
+	if (error_code & PF_USER)
+		fault = handle_speculative_fault(mm, address, flags);
+	if (fault != VM_FAULT_RETRY) {
+		if (fault & VM_FAULT_MAJOR) {
+			tsk->maj_flt++;
+			perf_sw_event(PERF_COUNT_SW_PAGE_FAULTS_MAJ, 1,
+				      regs, address);
+		} else {
+			tsk->min_flt++;
+			perf_sw_event(PERF_COUNT_SW_PAGE_FAULTS_MIN, 1,
+				      regs, address);
+		}
+		check_v8086_mode(regs, address, tsk);
+		return;
+	}
+#endif
+
 	/*
 	 * When running in the kernel we expect faults to occur only to
 	 * addresses in user space.  All other faults represent errors in
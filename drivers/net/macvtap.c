@@ -616,7 +616,7 @@ static int macvtap_skb_to_vnet_hdr(const struct sk_buff *skb,
 		else if (sinfo->gso_type & SKB_GSO_UDP)
 			vnet_hdr->gso_type = VIRTIO_NET_HDR_GSO_UDP;
 		else
-			BUG();
+			return -EINVAL;
 		if (sinfo->gso_type & SKB_GSO_TCP_ECN)
 			vnet_hdr->gso_type |= VIRTIO_NET_HDR_GSO_ECN;
 	} else
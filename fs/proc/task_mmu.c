@@ -402,8 +402,9 @@ static int smaps_pte_range(pmd_t *pmd, unsigned long addr, unsigned long end,
 		} else {
 			smaps_pte_entry(*(pte_t *)pmd, addr,
 					HPAGE_PMD_SIZE, walk);
+			if (!is_huge_zero_pmd(*pmd))
+				mss->anonymous_thp += HPAGE_PMD_SIZE;
 			spin_unlock(&walk->mm->page_table_lock);
-			mss->anonymous_thp += HPAGE_PMD_SIZE;
 			return 0;
 		}
 	} else {
@@ -509,7 +510,7 @@ static int clear_refs_pte_range(pmd_t *pmd, unsigned long addr,
 	spinlock_t *ptl;
 	struct page *page;
 
-	split_huge_page_pmd(walk->mm, pmd);
+	split_huge_page_pmd(walk->mm, addr, pmd);
 	if (pmd_trans_unstable(pmd))
 		return 0;
 
@@ -674,7 +675,7 @@ static int pagemap_pte_range(pmd_t *pmd, unsigned long addr, unsigned long end,
 	pte_t *pte;
 	int err = 0;
 
-	split_huge_page_pmd(walk->mm, pmd);
+	split_huge_page_pmd(walk->mm, addr, pmd);
 	if (pmd_trans_unstable(pmd))
 		return 0;
 
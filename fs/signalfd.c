@@ -41,8 +41,13 @@ void signalfd_cleanup(struct sighand_struct *sighand)
 	if (likely(!waitqueue_active(wqh)))
 		return;
 
-	/* wait_queue_t->func(POLLFREE) should do remove_wait_queue() */
-	wake_up_poll(wqh, POLLHUP | POLLFREE);
+	/*
+	 * wait_queue_t->func(POLLFREE) should do remove_wait_queue().
+	 * Wake every entry, exclusive ones included: an EPOLLEXCLUSIVE
+	 * epitem consumes the wakeup and would leave the others queued
+	 * on the sighand we are about to free.
+	 */
+	__wake_up(wqh, TASK_NORMAL, 0, (void *)(POLLHUP | POLLFREE));
 }
 
 struct signalfd_ctx {
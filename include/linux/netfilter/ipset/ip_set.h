@@ -274,6 +274,10 @@ struct ip_set_type_variant {
 	/* Return true if "b" set is the same as "a"
 	 * according to the create set parameters */
 	bool (*same_set)(const struct ip_set *a, const struct ip_set *b);
+
+	/* Kernelspace tests are safe under rcu_read_lock_bh() alone,
+	 * without the set lock */
+	bool rcu_test;
 };
 
 /* The core set type structure */
@@ -2,6 +2,7 @@
 #define _IP_SET_AHASH_H
 
 #include <linux/rcupdate.h>
+#include <linux/seqlock.h>
 #include <linux/jhash.h>
 #include <linux/netfilter/ipset/ip_set_timeout.h>
 
@@ -23,6 +24,13 @@
  * are serialized by the nfnl mutex. During resizing the set is
  * read-locked, so the only possible concurrent operations are
  * the kernel side readers. Those must be protected by proper RCU locking.
+ *
+ * Kernel side tests do not take the set lock at all, just
+ * rcu_read_lock_bh(). Writers still serialize on the set lock, but never
+ * modify a bucket readers can see: they build a new copy, publish it with
+ * rcu_assign_pointer() and free the old one after a grace period. The only
+ * in place update is refreshing the timeout of an existing element. The
+ * prefix book-keeping is reordered under a seqcount instead.
  */
 
 /* Number of elements to store in an initial array block */
@@ -57,18 +65,20 @@ tune_ahash_max(u8 curr, u32 multi)
 
 /* A hash bucket */
 struct hbucket {
-	void *value;		/* the array of the values */
+	struct rcu_head rcu;	/* freeing after replacement */
 	u8 size;		/* size of the array */
 	u8 pos;			/* position of the first free entry */
+	unsigned char value[0]	/* the array of the values */
+		__attribute__ ((aligned));
 };
 
 /* The hash table: the table size stored here in order to make resizing easy */
 struct htable {
 	u8 htable_bits;		/* size of hash table == 2^htable_bits */
-	struct hbucket bucket[0]; /* hashtable buckets */
+	struct hbucket __rcu *bucket[0]; /* hashtable buckets, NULL if empty */
 };
 
-#define hbucket(h, i)		(&((h)->bucket[i]))
+#define hbucket(h, i)		rcu_dereference_bh((h)->bucket[i])
 
 /* Book-keeping of the prefixes added to the set */
 struct ip_set_hash_nets {
@@ -95,6 +105,7 @@ struct ip_set_hash {
 	struct rb_root rbtree;
 #endif
 #ifdef IP_SET_HASH_WITH_NETS
+	seqcount_t nets_seq;	/* lockless tests vs. reordering nets[] */
 	struct ip_set_hash_nets nets[0]; /* book-keeping of prefixes */
 #endif
 };
@@ -131,6 +142,7 @@ add_cidr(struct ip_set_hash *h, u8 cidr, u8 host_mask)
 		return;
 
 	/* New cidr size */
+	write_seqcount_begin(&h->nets_seq);
 	for (i = 0; i < host_mask && h->nets[i].cidr; i++) {
 		/* Add in increasing prefix order, so larger cidr first */
 		if (h->nets[i].cidr < cidr)
@@ -138,6 +150,7 @@ add_cidr(struct ip_set_hash *h, u8 cidr, u8 host_mask)
 	}
 	if (i < host_mask)
 		h->nets[i].cidr = cidr;
+	write_seqcount_end(&h->nets_seq);
 }
 
 static void
@@ -153,27 +166,103 @@ del_cidr(struct ip_set_hash *h, u8 cidr, u8 host_mask)
 		return;
 
 	/* All entries with this cidr size deleted, so cleanup h->cidr[] */
+	write_seqcount_begin(&h->nets_seq);
 	for (i = 0; i < host_mask - 1 && h->nets[i].cidr; i++) {
 		if (h->nets[i].cidr == cidr)
 			h->nets[i].cidr = cidr = h->nets[i+1].cidr;
 	}
 	h->nets[i - 1].cidr = 0;
+	write_seqcount_end(&h->nets_seq);
 }
 #endif
 
-/* Destroy the hashtable part of the set */
+static void
+hbucket_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct hbucket, rcu));
+}
+
+/* Publish bucket n in place of the current one, which is freed when
+ * the readers are done with it. The set must be write locked. */
+static void
+hbucket_replace(struct htable *t, u32 i, struct hbucket *n)
+{
+	struct hbucket *old = hbucket(t, i);
+
+	rcu_assign_pointer(t->bucket[i], n);
+	if (old)
+		call_rcu_bh(&old->rcu, hbucket_free_rcu);
+}
+
+/* Copy the elements of bucket n (which may be NULL) except the one at
+ * skip, unless that is negative, and append room for extra elements. */
+static struct hbucket *
+hbucket_copy(const struct hbucket *n, int skip, u8 extra, size_t dsize)
+{
+	u8 pos = n ? n->pos : 0;
+	struct hbucket *m;
+
+	if (skip >= 0)
+		pos--;
+	/* FIXME: use slab cache */
+	m = kzalloc(sizeof(*m) + (pos + extra) * dsize, GFP_ATOMIC);
+	if (!m)
+		return NULL;
+	if (skip < 0) {
+		if (pos)
+			memcpy(m->value, n->value, pos * dsize);
+	} else {
+		memcpy(m->value, n->value, skip * dsize);
+		memcpy(m->value + skip * dsize, n->value + (skip + 1) * dsize,
+		       (pos - skip) * dsize);
+	}
+	m->size = m->pos = pos + extra;
+	return m;
+}
+
+/* Add an element to the new hash table when resizing the set. The table
+ * is not visible to readers yet, so its buckets can be grown in place and
+ * we spare the maintenance of the internal counters. */
+static int
+hbucket_elem_add(struct htable *t, u32 key, const void *value,
+		 size_t dsize, u8 ahash_max)
+{
+	struct hbucket *n = rcu_dereference_protected(t->bucket[key], 1);
+
+	if (!n || n->pos >= n->size) {
+		u8 size = n ? n->size : 0;
+		struct hbucket *tmp;
+
+		if (size >= ahash_max)
+			/* Trigger rehashing */
+			return -EAGAIN;
+
+		tmp = kzalloc(sizeof(*tmp) + (size + AHASH_INIT_SIZE) * dsize,
+			      GFP_ATOMIC);
+		if (!tmp)
+			return -ENOMEM;
+		if (n) {
+			memcpy(tmp->value, n->value, dsize * n->size);
+			tmp->pos = n->pos;
+			kfree(n);
+		}
+		tmp->size = size + AHASH_INIT_SIZE;
+		RCU_INIT_POINTER(t->bucket[key], tmp);
+		n = tmp;
+	}
+	memcpy(n->value + n->pos++ * dsize, value, dsize);
+	return 0;
+}
+
+/* Destroy the hashtable part of the set: no readers may be left */
 static void
 ahash_destroy(struct htable *t)
 {
-	struct hbucket *n;
 	u32 i;
 
-	for (i = 0; i < jhash_size(t->htable_bits); i++) {
-		n = hbucket(t, i);
-		if (n->size)
-			/* FIXME: use slab cache */
-			kfree(n->value);
-	}
+	for (i = 0; i < jhash_size(t->htable_bits); i++)
+		/* FIXME: use slab cache */
+		kfree(rcu_dereference_protected(t->bucket[i], 1));
 
 	ip_set_free(t);
 }
@@ -189,10 +278,14 @@ ahash_memsize(const struct ip_set_hash *h, size_t dsize, u8 host_mask)
 #ifdef IP_SET_HASH_WITH_NETS
 			 + sizeof(struct ip_set_hash_nets) * host_mask
 #endif
-			 + jhash_size(t->htable_bits) * sizeof(struct hbucket);
+			 + jhash_size(t->htable_bits) * sizeof(struct hbucket *);
+	const struct hbucket *n;
 
-	for (i = 0; i < jhash_size(t->htable_bits); i++)
-			memsize += t->bucket[i].size * dsize;
+	for (i = 0; i < jhash_size(t->htable_bits); i++) {
+		n = hbucket(t, i);
+		if (n)
+			memsize += sizeof(*n) + n->size * dsize;
+	}
 
 	return memsize;
 }
@@ -203,20 +296,15 @@ ip_set_hash_flush(struct ip_set *set)
 {
 	struct ip_set_hash *h = set->data;
 	struct htable *t = h->table;
-	struct hbucket *n;
 	u32 i;
 
-	for (i = 0; i < jhash_size(t->htable_bits); i++) {
-		n = hbucket(t, i);
-		if (n->size) {
-			n->size = n->pos = 0;
-			/* FIXME: use slab cache */
-			kfree(n->value);
-		}
-	}
+	for (i = 0; i < jhash_size(t->htable_bits); i++)
+		hbucket_replace(t, i, NULL);
 #ifdef IP_SET_HASH_WITH_NETS
+	write_seqcount_begin(&h->nets_seq);
 	memset(h->nets, 0, sizeof(struct ip_set_hash_nets)
 			   * SET_HOST_MASK(set->family));
+	write_seqcount_end(&h->nets_seq);
 #endif
 	h->elements = 0;
 }
@@ -269,13 +357,11 @@ ip_set_hash_destroy(struct ip_set *set)
 #define type_pf_data_expired	TOKEN(TYPE, PF, _data_expired)
 #define type_pf_data_timeout_set TOKEN(TYPE, PF, _data_timeout_set)
 
-#define type_pf_elem_add	TOKEN(TYPE, PF, _elem_add)
 #define type_pf_add		TOKEN(TYPE, PF, _add)
 #define type_pf_del		TOKEN(TYPE, PF, _del)
 #define type_pf_test_cidrs	TOKEN(TYPE, PF, _test_cidrs)
 #define type_pf_test		TOKEN(TYPE, PF, _test)
 
-#define type_pf_elem_tadd	TOKEN(TYPE, PF, _elem_tadd)
 #define type_pf_del_telem	TOKEN(TYPE, PF, _ahash_del_telem)
 #define type_pf_expire		TOKEN(TYPE, PF, _expire)
 #define type_pf_tadd		TOKEN(TYPE, PF, _tadd)
@@ -304,36 +390,6 @@ ip_set_hash_destroy(struct ip_set *set)
 #define ahash_data(n, i)	\
 	((struct type_pf_elem *)((n)->value) + (i))
 
-/* Add an element to the hash table when resizing the set:
- * we spare the maintenance of the internal counters. */
-static int
-type_pf_elem_add(struct hbucket *n, const struct type_pf_elem *value,
-		 u8 ahash_max)
-{
-	if (n->pos >= n->size) {
-		void *tmp;
-
-		if (n->size >= ahash_max)
-			/* Trigger rehashing */
-			return -EAGAIN;
-
-		tmp = kzalloc((n->size + AHASH_INIT_SIZE)
-			      * sizeof(struct type_pf_elem),
-			      GFP_ATOMIC);
-		if (!tmp)
-			return -ENOMEM;
-		if (n->size) {
-			memcpy(tmp, n->value,
-			       sizeof(struct type_pf_elem) * n->size);
-			kfree(n->value);
-		}
-		n->value = tmp;
-		n->size += AHASH_INIT_SIZE;
-	}
-	type_pf_data_copy(ahash_data(n, n->pos++), value);
-	return 0;
-}
-
 /* Resize a hash: create a new hash table with doubling the hashsize
  * and inserting the elements to it. Repeat until we succeed or
  * fail due to memory pressures. */
@@ -344,7 +400,7 @@ type_pf_resize(struct ip_set *set, bool retried)
 	struct htable *t, *orig = h->table;
 	u8 htable_bits = orig->htable_bits;
 	const struct type_pf_elem *data;
-	struct hbucket *n, *m;
+	struct hbucket *n;
 	u32 i, j;
 	int ret;
 
@@ -357,7 +413,7 @@ retry:
 		/* In case we have plenty of memory :-) */
 		return -IPSET_ERR_HASH_FULL;
 	t = ip_set_alloc(sizeof(*t)
-			 + jhash_size(htable_bits) * sizeof(struct hbucket));
+			 + jhash_size(htable_bits) * sizeof(struct hbucket *));
 	if (!t)
 		return -ENOMEM;
 	t->htable_bits = htable_bits;
@@ -365,10 +421,12 @@ retry:
 	read_lock_bh(&set->lock);
 	for (i = 0; i < jhash_size(orig->htable_bits); i++) {
 		n = hbucket(orig, i);
-		for (j = 0; j < n->pos; j++) {
+		for (j = 0; n && j < n->pos; j++) {
 			data = ahash_data(n, j);
-			m = hbucket(t, HKEY(data, h->initval, htable_bits));
-			ret = type_pf_elem_add(m, data, AHASH_MAX(h));
+			ret = hbucket_elem_add(t,
+					HKEY(data, h->initval, htable_bits),
+					data, sizeof(struct type_pf_elem),
+					AHASH_MAX(h));
 			if (ret < 0) {
 				read_unlock_bh(&set->lock);
 				ahash_destroy(t);
@@ -403,7 +461,7 @@ type_pf_add(struct ip_set *set, void *value, u32 timeout, u32 flags)
 	struct ip_set_hash *h = set->data;
 	struct htable *t;
 	const struct type_pf_elem *d = value;
-	struct hbucket *n;
+	struct hbucket *n, *m;
 	int i, ret = 0;
 	u32 key, multi = 0;
 
@@ -414,18 +472,25 @@ type_pf_add(struct ip_set *set, void *value, u32 timeout, u32 flags)
 	t = rcu_dereference_bh(h->table);
 	key = HKEY(value, h->initval, t->htable_bits);
 	n = hbucket(t, key);
-	for (i = 0; i < n->pos; i++)
+	for (i = 0; n && i < n->pos; i++)
 		if (type_pf_data_equal(ahash_data(n, i), d, &multi)) {
 			ret = -IPSET_ERR_EXIST;
 			goto out;
 		}
 	TUNE_AHASH_MAX(h, multi);
-	ret = type_pf_elem_add(n, value, AHASH_MAX(h));
-	if (ret != 0) {
-		if (ret == -EAGAIN)
-			type_pf_data_next(h, d);
+	if (n && n->pos >= AHASH_MAX(h)) {
+		/* Trigger rehashing */
+		type_pf_data_next(h, d);
+		ret = -EAGAIN;
+		goto out;
+	}
+	m = hbucket_copy(n, -1, 1, sizeof(struct type_pf_elem));
+	if (!m) {
+		ret = -ENOMEM;
 		goto out;
 	}
+	type_pf_data_copy(ahash_data(m, m->pos - 1), d);
+	hbucket_replace(t, key, m);
 
 #ifdef IP_SET_HASH_WITH_NETS
 	add_cidr(h, d->cidr, HOST_MASK);
@@ -436,8 +501,8 @@ out:
 	return ret;
 }
 
-/* Delete an element from the hash: swap it with the last element
- * and free up space if possible.
+/* Delete an element from the hash: replace the bucket by a copy
+ * without the element.
  */
 static int
 type_pf_del(struct ip_set *set, void *value, u32 timeout, u32 flags)
@@ -445,38 +510,27 @@ type_pf_del(struct ip_set *set, void *value, u32 timeout, u32 flags)
 	struct ip_set_hash *h = set->data;
 	struct htable *t = h->table;
 	const struct type_pf_elem *d = value;
-	struct hbucket *n;
+	struct hbucket *n, *m = NULL;
 	int i;
 	struct type_pf_elem *data;
 	u32 key, multi = 0;
 
 	key = HKEY(value, h->initval, t->htable_bits);
 	n = hbucket(t, key);
-	for (i = 0; i < n->pos; i++) {
+	for (i = 0; n && i < n->pos; i++) {
 		data = ahash_data(n, i);
 		if (!type_pf_data_equal(data, d, &multi))
 			continue;
-		if (i != n->pos - 1)
-			/* Not last one */
-			type_pf_data_copy(data, ahash_data(n, n->pos - 1));
-
-		n->pos--;
+		if (n->pos > 1) {
+			m = hbucket_copy(n, i, 0, sizeof(struct type_pf_elem));
+			if (!m)
+				return -ENOMEM;
+		}
+		hbucket_replace(t, key, m);
 		h->elements--;
 #ifdef IP_SET_HASH_WITH_NETS
 		del_cidr(h, d->cidr, HOST_MASK);
 #endif
-		if (n->pos + AHASH_INIT_SIZE < n->size) {
-			void *tmp = kzalloc((n->size - AHASH_INIT_SIZE)
-					    * sizeof(struct type_pf_elem),
-					    GFP_ATOMIC);
-			if (!tmp)
-				return 0;
-			n->size -= AHASH_INIT_SIZE;
-			memcpy(tmp, n->value,
-			       n->size * sizeof(struct type_pf_elem));
-			kfree(n->value);
-			n->value = tmp;
-		}
 		return 0;
 	}
 
@@ -491,24 +545,34 @@ static int
 type_pf_test_cidrs(struct ip_set *set, struct type_pf_elem *d, u32 timeout)
 {
 	struct ip_set_hash *h = set->data;
-	struct htable *t = h->table;
+	struct htable *t = rcu_dereference_bh(h->table);
 	struct hbucket *n;
 	const struct type_pf_elem *data;
-	int i, j = 0;
-	u32 key, multi = 0;
+	struct type_pf_elem orig = *d;
+	int i, j;
+	u32 key, multi;
 	u8 host_mask = SET_HOST_MASK(set->family);
+	unsigned int seq;
 
 	pr_debug("test by nets\n");
-	for (; j < host_mask && h->nets[j].cidr && !multi; j++) {
+retry:
+	seq = read_seqcount_begin(&h->nets_seq);
+	for (j = 0, multi = 0;
+	     j < host_mask && h->nets[j].cidr && !multi; j++) {
 		type_pf_data_netmask(d, h->nets[j].cidr);
 		key = HKEY(d, h->initval, t->htable_bits);
 		n = hbucket(t, key);
-		for (i = 0; i < n->pos; i++) {
+		for (i = 0; n && i < n->pos; i++) {
 			data = ahash_data(n, i);
 			if (type_pf_data_equal(data, d, &multi))
 				return 1;
 		}
 	}
+	/* A prefix we skipped may have been moved around */
+	if (read_seqcount_retry(&h->nets_seq, seq)) {
+		*d = orig;
+		goto retry;
+	}
 	return 0;
 }
 #endif
@@ -518,7 +582,7 @@ static int
 type_pf_test(struct ip_set *set, void *value, u32 timeout, u32 flags)
 {
 	struct ip_set_hash *h = set->data;
-	struct htable *t = h->table;
+	struct htable *t = rcu_dereference_bh(h->table);
 	struct type_pf_elem *d = value;
 	struct hbucket *n;
 	const struct type_pf_elem *data;
@@ -534,7 +598,7 @@ type_pf_test(struct ip_set *set, void *value, u32 timeout, u32 flags)
 
 	key = HKEY(d, h->initval, t->htable_bits);
 	n = hbucket(t, key);
-	for (i = 0; i < n->pos; i++) {
+	for (i = 0; n && i < n->pos; i++) {
 		data = ahash_data(n, i);
 		if (type_pf_data_equal(data, d, &multi))
 			return 1;
@@ -601,7 +665,7 @@ type_pf_list(const struct ip_set *set,
 		incomplete = skb_tail_pointer(skb);
 		n = hbucket(t, cb->args[2]);
 		pr_debug("cb->args[2]: %lu, t %p n %p\n", cb->args[2], t, n);
-		for (i = 0; i < n->pos; i++) {
+		for (i = 0; n && i < n->pos; i++) {
 			data = ahash_data(n, i);
 			pr_debug("list hash %lu hbucket %p i %u, data %p\n",
 				 cb->args[2], n, i, data);
@@ -658,6 +722,9 @@ static const struct ip_set_type_variant type_pf_variant = {
 	.list	= type_pf_list,
 	.resize	= type_pf_resize,
 	.same_set = type_pf_same_set,
+#ifndef IP_SET_HASH_WITH_RBTREE
+	.rcu_test = true,
+#endif
 };
 
 /* Flavour with timeout support */
@@ -691,50 +758,36 @@ type_pf_data_timeout_set(struct type_pf_elem *data, u32 timeout)
 	tdata->timeout = ip_set_timeout_set(timeout);
 }
 
-static int
-type_pf_elem_tadd(struct hbucket *n, const struct type_pf_elem *value,
-		  u8 ahash_max, u32 timeout)
-{
-	struct type_pf_elem *data;
-
-	if (n->pos >= n->size) {
-		void *tmp;
-
-		if (n->size >= ahash_max)
-			/* Trigger rehashing */
-			return -EAGAIN;
-
-		tmp = kzalloc((n->size + AHASH_INIT_SIZE)
-			      * sizeof(struct type_pf_telem),
-			      GFP_ATOMIC);
-		if (!tmp)
-			return -ENOMEM;
-		if (n->size) {
-			memcpy(tmp, n->value,
-			       sizeof(struct type_pf_telem) * n->size);
-			kfree(n->value);
-		}
-		n->value = tmp;
-		n->size += AHASH_INIT_SIZE;
-	}
-	data = ahash_tdata(n, n->pos++);
-	type_pf_data_copy(data, value);
-	type_pf_data_timeout_set(data, timeout);
-	return 0;
-}
-
 /* Delete expired elements from the hashtable */
 static void
 type_pf_expire(struct ip_set_hash *h)
 {
 	struct htable *t = h->table;
-	struct hbucket *n;
+	struct hbucket *n, *m;
 	struct type_pf_elem *data;
 	u32 i;
-	int j;
+	int j, k;
 
 	for (i = 0; i < jhash_size(t->htable_bits); i++) {
 		n = hbucket(t, i);
+		if (!n)
+			continue;
+		for (j = 0, k = 0; j < n->pos; j++)
+			if (type_pf_data_expired(ahash_tdata(n, j)))
+				k++;
+		if (!k)
+			continue;
+		m = NULL;
+		if (k < n->pos) {
+			m = kzalloc(sizeof(*m) + (n->pos - k)
+					* sizeof(struct type_pf_telem),
+				    GFP_ATOMIC);
+			if (!m)
+				/* Try again at the next run */
+				continue;
+			m->size = n->pos - k;
+		}
+		/* Elements may expire meanwhile: this pass decides */
 		for (j = 0; j < n->pos; j++) {
 			data = ahash_tdata(n, j);
 			if (type_pf_data_expired(data)) {
@@ -742,27 +795,12 @@ type_pf_expire(struct ip_set_hash *h)
 #ifdef IP_SET_HASH_WITH_NETS
 				del_cidr(h, data->cidr, HOST_MASK);
 #endif
-				if (j != n->pos - 1)
-					/* Not last one */
-					type_pf_data_copy(data,
-						ahash_tdata(n, n->pos - 1));
-				n->pos--;
 				h->elements--;
-			}
-		}
-		if (n->pos + AHASH_INIT_SIZE < n->size) {
-			void *tmp = kzalloc((n->size - AHASH_INIT_SIZE)
-					    * sizeof(struct type_pf_telem),
-					    GFP_ATOMIC);
-			if (!tmp)
-				/* Still try to delete expired elements */
-				continue;
-			n->size -= AHASH_INIT_SIZE;
-			memcpy(tmp, n->value,
-			       n->size * sizeof(struct type_pf_telem));
-			kfree(n->value);
-			n->value = tmp;
+			} else
+				memcpy(ahash_tdata(m, m->pos++), data,
+				       sizeof(struct type_pf_telem));
 		}
+		hbucket_replace(t, i, m);
 	}
 }
 
@@ -773,7 +811,7 @@ type_pf_tresize(struct ip_set *set, bool retried)
 	struct htable *t, *orig = h->table;
 	u8 htable_bits = orig->htable_bits;
 	const struct type_pf_elem *data;
-	struct hbucket *n, *m;
+	struct hbucket *n;
 	u32 i, j;
 	int ret;
 
@@ -794,7 +832,7 @@ retry:
 		/* In case we have plenty of memory :-) */
 		return -IPSET_ERR_HASH_FULL;
 	t = ip_set_alloc(sizeof(*t)
-			 + jhash_size(htable_bits) * sizeof(struct hbucket));
+			 + jhash_size(htable_bits) * sizeof(struct hbucket *));
 	if (!t)
 		return -ENOMEM;
 	t->htable_bits = htable_bits;
@@ -802,11 +840,13 @@ retry:
 	read_lock_bh(&set->lock);
 	for (i = 0; i < jhash_size(orig->htable_bits); i++) {
 		n = hbucket(orig, i);
-		for (j = 0; j < n->pos; j++) {
+		for (j = 0; n && j < n->pos; j++) {
 			data = ahash_tdata(n, j);
-			m = hbucket(t, HKEY(data, h->initval, htable_bits));
-			ret = type_pf_elem_tadd(m, data, AHASH_MAX(h),
-						type_pf_data_timeout(data));
+			/* Copied with the timeout as it is */
+			ret = hbucket_elem_add(t,
+					HKEY(data, h->initval, htable_bits),
+					data, sizeof(struct type_pf_telem),
+					AHASH_MAX(h));
 			if (ret < 0) {
 				read_unlock_bh(&set->lock);
 				ahash_destroy(t);
@@ -834,10 +874,10 @@ type_pf_tadd(struct ip_set *set, void *value, u32 timeout, u32 flags)
 	struct ip_set_hash *h = set->data;
 	struct htable *t = h->table;
 	const struct type_pf_elem *d = value;
-	struct hbucket *n;
+	struct hbucket *n, *m;
 	struct type_pf_elem *data;
 	int ret = 0, i, j = AHASH_MAX(h) + 1;
-	bool flag_exist = flags & IPSET_FLAG_EXIST;
+	bool flag_exist = flags & IPSET_FLAG_EXIST, same = false;
 	u32 key, multi = 0;
 
 	if (h->elements >= h->maxelem)
@@ -850,12 +890,13 @@ type_pf_tadd(struct ip_set *set, void *value, u32 timeout, u32 flags)
 	t = rcu_dereference_bh(h->table);
 	key = HKEY(d, h->initval, t->htable_bits);
 	n = hbucket(t, key);
-	for (i = 0; i < n->pos; i++) {
+	for (i = 0; n && i < n->pos; i++) {
 		data = ahash_tdata(n, i);
 		if (type_pf_data_equal(data, d, &multi)) {
-			if (type_pf_data_expired(data) || flag_exist)
+			if (type_pf_data_expired(data) || flag_exist) {
 				j = i;
-			else {
+				same = true;
+			} else {
 				ret = -IPSET_ERR_EXIST;
 				goto out;
 			}
@@ -865,21 +906,43 @@ type_pf_tadd(struct ip_set *set, void *value, u32 timeout, u32 flags)
 	}
 	if (j != AHASH_MAX(h) + 1) {
 		data = ahash_tdata(n, j);
+		if (same) {
+			/* Readers see the old or the new timeout */
+			type_pf_data_timeout_set(data, timeout);
+			goto out;
+		}
+		/* Replace the expired element */
+		m = hbucket_copy(n, j, 1, sizeof(struct type_pf_telem));
+		if (!m) {
+			ret = -ENOMEM;
+			goto out;
+		}
 #ifdef IP_SET_HASH_WITH_NETS
 		del_cidr(h, data->cidr, HOST_MASK);
 		add_cidr(h, d->cidr, HOST_MASK);
 #endif
+		data = ahash_tdata(m, m->pos - 1);
 		type_pf_data_copy(data, d);
 		type_pf_data_timeout_set(data, timeout);
+		hbucket_replace(t, key, m);
 		goto out;
 	}
 	TUNE_AHASH_MAX(h, multi);
-	ret = type_pf_elem_tadd(n, d, AHASH_MAX(h), timeout);
-	if (ret != 0) {
-		if (ret == -EAGAIN)
-			type_pf_data_next(h, d);
+	if (n && n->pos >= AHASH_MAX(h)) {
+		/* Trigger rehashing */
+		type_pf_data_next(h, d);
+		ret = -EAGAIN;
+		goto out;
+	}
+	m = hbucket_copy(n, -1, 1, sizeof(struct type_pf_telem));
+	if (!m) {
+		ret = -ENOMEM;
 		goto out;
 	}
+	data = ahash_tdata(m, m->pos - 1);
+	type_pf_data_copy(data, d);
+	type_pf_data_timeout_set(data, timeout);
+	hbucket_replace(t, key, m);
 
 #ifdef IP_SET_HASH_WITH_NETS
 	add_cidr(h, d->cidr, HOST_MASK);
@@ -896,40 +959,29 @@ type_pf_tdel(struct ip_set *set, void *value, u32 timeout, u32 flags)
 	struct ip_set_hash *h = set->data;
 	struct htable *t = h->table;
 	const struct type_pf_elem *d = value;
-	struct hbucket *n;
+	struct hbucket *n, *m = NULL;
 	int i;
 	struct type_pf_elem *data;
 	u32 key, multi = 0;
 
 	key = HKEY(value, h->initval, t->htable_bits);
 	n = hbucket(t, key);
-	for (i = 0; i < n->pos; i++) {
+	for (i = 0; n && i < n->pos; i++) {
 		data = ahash_tdata(n, i);
 		if (!type_pf_data_equal(data, d, &multi))
 			continue;
 		if (type_pf_data_expired(data))
 			return -IPSET_ERR_EXIST;
-		if (i != n->pos - 1)
-			/* Not last one */
-			type_pf_data_copy(data, ahash_tdata(n, n->pos - 1));
-
-		n->pos--;
+		if (n->pos > 1) {
+			m = hbucket_copy(n, i, 0, sizeof(struct type_pf_telem));
+			if (!m)
+				return -ENOMEM;
+		}
+		hbucket_replace(t, key, m);
 		h->elements--;
 #ifdef IP_SET_HASH_WITH_NETS
 		del_cidr(h, d->cidr, HOST_MASK);
 #endif
-		if (n->pos + AHASH_INIT_SIZE < n->size) {
-			void *tmp = kzalloc((n->size - AHASH_INIT_SIZE)
-					    * sizeof(struct type_pf_telem),
-					    GFP_ATOMIC);
-			if (!tmp)
-				return 0;
-			n->size -= AHASH_INIT_SIZE;
-			memcpy(tmp, n->value,
-			       n->size * sizeof(struct type_pf_telem));
-			kfree(n->value);
-			n->value = tmp;
-		}
 		return 0;
 	}
 
@@ -941,23 +993,32 @@ static int
 type_pf_ttest_cidrs(struct ip_set *set, struct type_pf_elem *d, u32 timeout)
 {
 	struct ip_set_hash *h = set->data;
-	struct htable *t = h->table;
+	struct htable *t = rcu_dereference_bh(h->table);
 	struct type_pf_elem *data;
+	struct type_pf_elem orig = *d;
 	struct hbucket *n;
-	int i, j = 0;
-	u32 key, multi = 0;
+	int i, j;
+	u32 key, multi;
 	u8 host_mask = SET_HOST_MASK(set->family);
+	unsigned int seq;
 
-	for (; j < host_mask && h->nets[j].cidr && !multi; j++) {
+retry:
+	seq = read_seqcount_begin(&h->nets_seq);
+	for (j = 0, multi = 0;
+	     j < host_mask && h->nets[j].cidr && !multi; j++) {
 		type_pf_data_netmask(d, h->nets[j].cidr);
 		key = HKEY(d, h->initval, t->htable_bits);
 		n = hbucket(t, key);
-		for (i = 0; i < n->pos; i++) {
+		for (i = 0; n && i < n->pos; i++) {
 			data = ahash_tdata(n, i);
 			if (type_pf_data_equal(data, d, &multi))
 				return !type_pf_data_expired(data);
 		}
 	}
+	if (read_seqcount_retry(&h->nets_seq, seq)) {
+		*d = orig;
+		goto retry;
+	}
 	return 0;
 }
 #endif
@@ -966,7 +1027,7 @@ static int
 type_pf_ttest(struct ip_set *set, void *value, u32 timeout, u32 flags)
 {
 	struct ip_set_hash *h = set->data;
-	struct htable *t = h->table;
+	struct htable *t = rcu_dereference_bh(h->table);
 	struct type_pf_elem *data, *d = value;
 	struct hbucket *n;
 	int i;
@@ -978,7 +1039,7 @@ type_pf_ttest(struct ip_set *set, void *value, u32 timeout, u32 flags)
 #endif
 	key = HKEY(d, h->initval, t->htable_bits);
 	n = hbucket(t, key);
-	for (i = 0; i < n->pos; i++) {
+	for (i = 0; n && i < n->pos; i++) {
 		data = ahash_tdata(n, i);
 		if (type_pf_data_equal(data, d, &multi))
 			return !type_pf_data_expired(data);
@@ -1006,7 +1067,7 @@ type_pf_tlist(const struct ip_set *set,
 	for (; cb->args[2] < jhash_size(t->htable_bits); cb->args[2]++) {
 		incomplete = skb_tail_pointer(skb);
 		n = hbucket(t, cb->args[2]);
-		for (i = 0; i < n->pos; i++) {
+		for (i = 0; n && i < n->pos; i++) {
 			data = ahash_tdata(n, i);
 			pr_debug("list %p %u\n", n, i);
 			if (type_pf_data_expired(data))
@@ -1057,6 +1118,9 @@ static const struct ip_set_type_variant type_pf_tvariant = {
 	.list	= type_pf_tlist,
 	.resize	= type_pf_tresize,
 	.same_set = type_pf_same_set,
+#ifndef IP_SET_HASH_WITH_RBTREE
+	.rcu_test = true,
+#endif
 };
 
 static void
@@ -1104,13 +1168,11 @@ type_pf_gc_init(struct ip_set *set)
 #undef type_pf_data_netmask
 #undef type_pf_data_timeout_set
 
-#undef type_pf_elem_add
 #undef type_pf_add
 #undef type_pf_del
 #undef type_pf_test_cidrs
 #undef type_pf_test
 
-#undef type_pf_elem_tadd
 #undef type_pf_expire
 #undef type_pf_tadd
 #undef type_pf_tdel
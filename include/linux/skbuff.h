@@ -224,11 +224,26 @@ enum {
  * The callback notifies userspace to release buffers when skb DMA is done in
  * lower device, the skb last reference should be 0 when calling this.
  * The desc is used to track userspace buffer index.
+ *
+ * Sockets sending with MSG_ZEROCOPY use the second layout instead: id and
+ * len describe the range of sendmsg calls the buffer completes, and every
+ * skb holding user pages takes a reference on refcnt.
  */
 struct ubuf_info {
 	void (*callback)(void *);
-	void *arg;
-	unsigned long desc;
+	union {
+		struct {
+			void *arg;
+			unsigned long desc;
+		};
+		struct {
+			u32 id;
+			u16 len;
+			u16 zerocopy:1;
+			u32 bytelen;
+		};
+	};
+	atomic_t refcnt;
 };
 
 /* This data is invariant across clones and lives at
@@ -292,6 +307,8 @@ enum {
 	SKB_GSO_TCPV6 = 1 << 4,
 
 	SKB_GSO_FCOE = 1 << 5,
+
+	SKB_GSO_UDP_L4 = 1 << 6,
 };
 
 #if BITS_PER_LONG > 32
@@ -352,6 +369,7 @@ typedef unsigned char *sk_buff_data_t;
  *	@ooo_okay: allow the mapping of a socket to a queue to be changed
  *	@l4_rxhash: indicate rxhash is a canonical 4-tuple hash over transport
  *		ports.
+ *	@napi_id: id of the NAPI struct this skb came from
  *	@dma_cookie: a cookie to one of several possible DMA operations
  *		done by skb DMA functions
  *	@secmark: security marking
@@ -409,6 +427,16 @@ struct sk_buff {
 				ip_summed:2,
 				nohdr:1,
 				nfctinfo:3;
+
+/* if you move pkt_type around you also must adapt those constants */
+#ifdef __BIG_ENDIAN_BITFIELD
+#define PKT_TYPE_MAX	(7 << 5)
+#else
+#define PKT_TYPE_MAX	7
+#endif
+#define PKT_TYPE_OFFSET()	offsetof(struct sk_buff, __pkt_type_offset)
+
+	__u8			__pkt_type_offset[0];
 	__u8			pkt_type:3,
 				fclone:2,
 				ipvs_property:1,
@@ -449,8 +477,11 @@ struct sk_buff {
 
 	/* 0/13 bit hole */
 
-#ifdef CONFIG_NET_DMA
-	dma_cookie_t		dma_cookie;
+#if defined(CONFIG_NET_DMA) || defined(CONFIG_NET_RX_BUSY_POLL)
+	union {
+		unsigned int	napi_id;
+		dma_cookie_t	dma_cookie;
+	};
 #endif
 #ifdef CONFIG_NETWORK_SECMARK
 	__u32			secmark;
@@ -558,6 +589,11 @@ extern bool skb_recycle_check(struct sk_buff *skb, int skb_size);
 
 extern struct sk_buff *skb_morph(struct sk_buff *dst, struct sk_buff *src);
 extern int skb_copy_ubufs(struct sk_buff *skb, gfp_t gfp_mask);
+extern struct ubuf_info *sock_zerocopy_alloc(struct sock *sk, size_t size);
+extern void sock_zerocopy_callback(void *arg);
+extern void sock_zerocopy_put(struct ubuf_info *uarg);
+extern void sock_zerocopy_put_abort(struct ubuf_info *uarg);
+
 extern struct sk_buff *skb_clone(struct sk_buff *skb,
 				 gfp_t priority);
 extern struct sk_buff *skb_copy(const struct sk_buff *skb,
@@ -635,6 +671,57 @@ static inline struct skb_shared_hwtstamps *skb_hwtstamps(struct sk_buff *skb)
 	return &skb_shinfo(skb)->hwtstamps;
 }
 
+static inline struct ubuf_info *skb_zcopy(struct sk_buff *skb)
+{
+	if (skb && (skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY))
+		return skb_shinfo(skb)->destructor_arg;
+	return NULL;
+}
+
+static inline bool skb_zcopy_is_sock(const struct ubuf_info *uarg)
+{
+	return uarg->callback == sock_zerocopy_callback;
+}
+
+static inline void sock_zerocopy_get(struct ubuf_info *uarg)
+{
+	atomic_inc(&uarg->refcnt);
+}
+
+/* Attach a socket zerocopy buffer to an skb that has none yet */
+static inline void skb_zcopy_set(struct sk_buff *skb, struct ubuf_info *uarg)
+{
+	if (skb && uarg && !skb_zcopy(skb)) {
+		sock_zerocopy_get(uarg);
+		skb_shinfo(skb)->destructor_arg = uarg;
+		skb_shinfo(skb)->tx_flags |= SKBTX_DEV_ZEROCOPY;
+	}
+}
+
+/* Carry the socket zerocopy buffer of @orig over to @nskb, which now
+ * shares some of its user frags.
+ */
+static inline void skb_zerocopy_clone(struct sk_buff *nskb,
+				      struct sk_buff *orig)
+{
+	struct ubuf_info *uarg = skb_zcopy(orig);
+
+	if (uarg && skb_zcopy_is_sock(uarg))
+		skb_zcopy_set(nskb, uarg);
+}
+
+/* Buffers from vhost and macvtap must be copied before the skb data can be
+ * shared, socket zerocopy buffers are reference counted instead.
+ */
+static inline int skb_orphan_frags(struct sk_buff *skb, gfp_t gfp_mask)
+{
+	struct ubuf_info *uarg = skb_zcopy(skb);
+
+	if (likely(!uarg) || skb_zcopy_is_sock(uarg))
+		return 0;
+	return skb_copy_ubufs(skb, gfp_mask);
+}
+
 /**
  *	skb_queue_empty - check if a queue is empty
  *	@list: queue head
@@ -2079,8 +2166,33 @@ static inline void skb_frag_add_head(struct sk_buff *skb, struct sk_buff *frag)
 #define skb_walk_frags(skb, iter)	\
 	for (iter = skb_shinfo(skb)->frag_list; iter; iter = iter->next)
 
+/**
+ *	struct skb_batch - datagrams dequeued in bulk by recvmmsg()
+ *	@queue: oldest datagrams taken off sk_receive_queue but not consumed
+ *		yet, hidden from other readers until skb_batch_release()
+ *	@done: consumed datagrams, freed together by skb_batch_release()
+ *	@budget: how many more datagrams may be moved to @queue
+ */
+struct skb_batch {
+	struct sk_buff_head	queue;
+	struct sk_buff_head	done;
+	unsigned int		budget;
+};
+
+static inline void skb_batch_init(struct skb_batch *batch,
+				  unsigned int budget)
+{
+	__skb_queue_head_init(&batch->queue);
+	__skb_queue_head_init(&batch->done);
+	batch->budget = budget;
+}
+
 extern struct sk_buff *__skb_recv_datagram(struct sock *sk, unsigned flags,
 					   int *peeked, int *err);
+extern struct sk_buff *skb_recv_datagram_batch(struct sock *sk,
+					       struct skb_batch *batch,
+					       unsigned flags, int *peeked,
+					       int *err);
 extern struct sk_buff *skb_recv_datagram(struct sock *sk, unsigned flags,
 					 int noblock, int *err);
 extern unsigned int    datagram_poll(struct file *file, struct socket *sock,
@@ -2096,6 +2208,9 @@ extern int	       skb_copy_datagram_from_iovec(struct sk_buff *skb,
 						    const struct iovec *from,
 						    int from_offset,
 						    int len);
+extern int	       skb_zerocopy_add_iovec(struct sk_buff *skb,
+					      const struct iovec *iov,
+					      int offset, int len);
 extern int	       skb_copy_datagram_const_iovec(const struct sk_buff *from,
 						     int offset,
 						     const struct iovec *to,
@@ -2104,6 +2219,11 @@ extern int	       skb_copy_datagram_const_iovec(const struct sk_buff *from,
 extern void	       skb_free_datagram(struct sock *sk, struct sk_buff *skb);
 extern void	       skb_free_datagram_locked(struct sock *sk,
 						struct sk_buff *skb);
+extern void	       skb_free_datagram_batch(struct sock *sk,
+					       struct skb_batch *batch,
+					       struct sk_buff *skb);
+extern void	       skb_batch_release(struct sock *sk,
+					 struct skb_batch *batch);
 extern int	       skb_kill_datagram(struct sock *sk, struct sk_buff *skb,
 					 unsigned int flags);
 extern __wsum	       skb_checksum(const struct sk_buff *skb, int offset,
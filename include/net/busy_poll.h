@@ -0,0 +1,119 @@
+/*
+ * busy_poll.h	Low latency receive by busy polling the device
+ *
+ * Sockets with a non zero busy poll budget spin on the NAPI context that
+ * last delivered a packet to them, instead of sleeping until the
+ * interrupt -> softirq -> wakeup chain hands the packet over.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#ifndef _NET_BUSY_POLL_H
+#define _NET_BUSY_POLL_H
+
+#include <linux/netdevice.h>
+#include <linux/sched.h>
+#include <linux/poll.h>
+#include <net/sock.h>
+
+#ifdef CONFIG_NET_RX_BUSY_POLL
+
+extern unsigned int sysctl_net_busy_read __read_mostly;
+extern unsigned int sysctl_net_busy_poll __read_mostly;
+
+/* Set by sock_poll() in the returned mask, see do_select()/do_poll() */
+#define POLL_BUSY_LOOP		0x8000
+
+/* Packets asked from the driver per busy poll round */
+#define BUSY_POLL_BUDGET	8
+
+static inline bool net_busy_loop_on(void)
+{
+	return sysctl_net_busy_poll;
+}
+
+static inline bool sk_can_busy_loop(const struct sock *sk)
+{
+	return sk->sk_ll_usec && sk->sk_napi_id && !signal_pending(current);
+}
+
+/* Rough microseconds, good enough to bound a busy wait */
+static inline unsigned long busy_loop_us_clock(void)
+{
+	return local_clock() >> 10;
+}
+
+/* poll(), select() and epoll use the global sysctl_net_busy_poll budget */
+static inline unsigned long busy_loop_end_time(void)
+{
+	return busy_loop_us_clock() + ACCESS_ONCE(sysctl_net_busy_poll);
+}
+
+static inline unsigned long sk_busy_loop_end_time(const struct sock *sk)
+{
+	return busy_loop_us_clock() + ACCESS_ONCE(sk->sk_ll_usec);
+}
+
+static inline bool busy_loop_timeout(unsigned long end_time)
+{
+	return time_after(busy_loop_us_clock(), end_time);
+}
+
+extern int napi_busy_loop(unsigned int napi_id, unsigned long end_time,
+			  bool (*loop_end)(void *arg), void *arg);
+extern bool sk_busy_loop(struct sock *sk, int nonblock);
+
+static inline void skb_mark_napi_id(struct sk_buff *skb,
+				    const struct napi_struct *napi)
+{
+	skb->napi_id = napi->napi_id;
+}
+
+static inline void sk_mark_napi_id(struct sock *sk, const struct sk_buff *skb)
+{
+	sk->sk_napi_id = skb->napi_id;
+}
+
+#else /* CONFIG_NET_RX_BUSY_POLL */
+
+#define POLL_BUSY_LOOP		0
+
+static inline bool net_busy_loop_on(void)
+{
+	return false;
+}
+
+static inline bool sk_can_busy_loop(const struct sock *sk)
+{
+	return false;
+}
+
+static inline unsigned long busy_loop_end_time(void)
+{
+	return 0;
+}
+
+static inline bool busy_loop_timeout(unsigned long end_time)
+{
+	return true;
+}
+
+static inline bool sk_busy_loop(struct sock *sk, int nonblock)
+{
+	return false;
+}
+
+static inline void skb_mark_napi_id(struct sk_buff *skb,
+				    const struct napi_struct *napi)
+{
+}
+
+static inline void sk_mark_napi_id(struct sock *sk, const struct sk_buff *skb)
+{
+}
+
+#endif /* CONFIG_NET_RX_BUSY_POLL */
+#endif /* _NET_BUSY_POLL_H */
@@ -4,9 +4,22 @@
 #include <linux/list.h>
 #include <linux/list_nulls.h>
 #include <linux/atomic.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
 
 struct ctl_table_header;
 struct nf_conntrack_ecache;
+struct nf_conntrack_tuple_hash;
+
+/* Number of recently found conntracks remembered per cpu */
+#define NF_CT_PCPU_CACHE_SIZE	64
+
+struct ct_pcpu {
+	spinlock_t		lock;
+	struct hlist_nulls_head	unconfirmed;
+	struct hlist_nulls_head	dying;
+	struct nf_conntrack_tuple_hash *cache[NF_CT_PCPU_CACHE_SIZE];
+};
 
 struct netns_ct {
 	atomic_t		count;
@@ -14,9 +27,9 @@ struct netns_ct {
 	unsigned int		htable_size;
 	struct kmem_cache	*nf_conntrack_cachep;
 	struct hlist_nulls_head	*hash;
+	seqcount_t		generation;
 	struct hlist_head	*expect_hash;
-	struct hlist_nulls_head	unconfirmed;
-	struct hlist_nulls_head	dying;
+	struct ct_pcpu __percpu	*pcpu_lists;
 	struct ip_conntrack_stat __percpu *stat;
 	struct nf_ct_event_notifier __rcu *nf_conntrack_event_cb;
 	struct nf_exp_event_notifier __rcu *nf_expect_event_cb;
@@ -303,6 +303,7 @@ static inline void sch_tree_unlock(const struct Qdisc *q)
 extern struct Qdisc noop_qdisc;
 extern struct Qdisc_ops noop_qdisc_ops;
 extern struct Qdisc_ops pfifo_fast_ops;
+extern struct Qdisc_ops *default_qdisc_ops;
 extern struct Qdisc_ops mq_qdisc_ops;
 
 struct Qdisc_class_common {
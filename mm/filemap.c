@@ -1759,8 +1759,79 @@ page_not_uptodate:
 }
 EXPORT_SYMBOL(filemap_fault);
 
+/**
+ * filemap_map_pages - map the cached pages around a read fault
+ * @vma:	vma in which the fault was taken
+ * @vmf:	range of offsets and their ptes, see struct vm_fault
+ *
+ * Called with the pte lock held: only pages that are uptodate and can be
+ * locked without waiting are mapped, everything else is left to be
+ * faulted in through filemap_fault(), which also keeps readahead going.
+ */
+void filemap_map_pages(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct file *file = vma->vm_file;
+	struct address_space *mapping = file->f_mapping;
+	struct file_ra_state *ra = &file->f_ra;
+	unsigned long address = (unsigned long) vmf->virtual_address;
+	struct page *pages[PAGEVEC_SIZE];
+	pgoff_t index = vmf->pgoff;
+	pgoff_t last = vmf->max_pgoff;
+	pgoff_t size;
+	unsigned int i, nr;
+
+	size = (i_size_read(mapping->host) + PAGE_CACHE_SIZE - 1) >>
+							PAGE_CACHE_SHIFT;
+	if (!size)
+		return;
+	if (last >= size)
+		last = size - 1;
+
+	while (index <= last) {
+		nr = find_get_pages(mapping, index,
+				    min_t(pgoff_t, PAGEVEC_SIZE, last - index + 1),
+				    pages);
+		if (!nr)
+			break;
+		for (i = 0; i < nr; i++) {
+			struct page *page = pages[i];
+			pte_t *pte;
+
+			index = page->index + 1;
+			if (page->index > last)
+				goto skip;
+			if (!PageUptodate(page) || PageReadahead(page) ||
+			    PageHWPoison(page))
+				goto skip;
+			if (!trylock_page(page))
+				goto skip;
+			/* Truncated or invalidated meanwhile? */
+			if (page->mapping != mapping || !PageUptodate(page))
+				goto unlock;
+
+			pte = vmf->pte + page->index - vmf->pgoff;
+			if (!pte_none(*pte))
+				goto unlock;
+
+			if (ra->mmap_miss > 0)
+				ra->mmap_miss--;
+			do_set_pte(vma, address +
+				   ((page->index - vmf->pgoff) << PAGE_SHIFT),
+				   page, pte);
+			unlock_page(page);
+			continue;
+unlock:
+			unlock_page(page);
+skip:
+			page_cache_release(page);
+		}
+	}
+}
+EXPORT_SYMBOL(filemap_map_pages);
+
 const struct vm_operations_struct generic_file_vm_ops = {
 	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
 };
 
 /* This is used for a general mmap of a disk file */
@@ -13,6 +13,12 @@
 
 #include <linux/mm.h>
 
+void put_vma(struct vm_area_struct *vma);
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+struct vm_area_struct *get_vma_speculative(struct mm_struct *mm,
+					   unsigned long addr, unsigned int *seq);
+#endif
+
 void free_pgtables(struct mmu_gather *tlb, struct vm_area_struct *start_vma,
 		unsigned long floor, unsigned long ceiling);
 
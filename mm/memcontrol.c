@@ -5242,7 +5242,7 @@ static int mem_cgroup_count_precharge_pte_range(pmd_t *pmd,
 	pte_t *pte;
 	spinlock_t *ptl;
 
-	split_huge_page_pmd(walk->mm, pmd);
+	split_huge_page_pmd(walk->mm, addr, pmd);
 	if (pmd_trans_unstable(pmd))
 		return 0;
 
@@ -5405,7 +5405,7 @@ static int mem_cgroup_move_charge_pte_range(pmd_t *pmd,
 	pte_t *pte;
 	spinlock_t *ptl;
 
-	split_huge_page_pmd(walk->mm, pmd);
+	split_huge_page_pmd(walk->mm, addr, pmd);
 	if (pmd_trans_unstable(pmd))
 		return 0;
 retry:
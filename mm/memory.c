@@ -57,6 +57,7 @@
 #include <linux/swapops.h>
 #include <linux/elf.h>
 #include <linux/gfp.h>
+#include <linux/debugfs.h>
 
 #include <asm/io.h>
 #include <asm/pgalloc.h>
@@ -1302,7 +1303,7 @@ static inline unsigned long zap_pmd_range(struct mmu_gather *tlb,
 		if (pmd_trans_huge(*pmd)) {
 			if (next - addr != HPAGE_PMD_SIZE) {
 				VM_BUG_ON(!rwsem_is_locked(&tlb->mm->mmap_sem));
-				split_huge_page_pmd(vma->vm_mm, pmd);
+				split_huge_page_pmd(vma->vm_mm, addr, pmd);
 			} else if (zap_huge_pmd(tlb, vma, pmd))
 				goto next;
 			/* fall through */
@@ -1544,7 +1545,7 @@ struct page *follow_page(struct vm_area_struct *vma, unsigned long address,
 	}
 	if (pmd_trans_huge(*pmd)) {
 		if (flags & FOLL_SPLIT) {
-			split_huge_page_pmd(mm, pmd);
+			split_huge_page_pmd(mm, address, pmd);
 			goto split_fallthrough;
 		}
 		spin_lock(&mm->page_table_lock);
@@ -3115,14 +3116,104 @@ static inline int check_stack_guard_page(struct vm_area_struct *vma, unsigned lo
 	return 0;
 }
 
+/*
+ * Map and lock the pte for address.  Under mmap_sem this cannot fail.
+ *
+ * For a speculative fault the page tables are walked again with
+ * interrupts disabled, which holds off their freeing as the TLB flush
+ * IPI has to wait for us, and the vma is checked not to have changed
+ * since seq was sampled.  The pte lock is only trylocked: its holder
+ * may be waiting for our IPI.  On success interrupts are left disabled
+ * until pte_unmap_unlock_fault(); on failure the fault has to be
+ * retried under mmap_sem.
+ */
+static bool pte_map_lock(struct mm_struct *mm, struct vm_area_struct *vma,
+			 unsigned long address, pmd_t *pmd, unsigned int flags,
+			 unsigned int seq, pte_t **ptep, spinlock_t **ptlp)
+{
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t pmdval;
+	spinlock_t *ptl;
+	pte_t *pte;
+
+	if (!(flags & FAULT_FLAG_SPECULATIVE))
+		goto locked;
+
+	local_irq_disable();
+	if (read_seqcount_retry(&vma->vm_sequence, seq))
+		goto fail;
+
+	pgd = pgd_offset(mm, address);
+	if (pgd_none(*pgd) || unlikely(pgd_bad(*pgd)))
+		goto fail;
+	pud = pud_offset(pgd, address);
+	if (pud_none(*pud) || unlikely(pud_bad(*pud)))
+		goto fail;
+	pmd = pmd_offset(pud, address);
+	pmdval = *pmd;
+	barrier();
+	if (pmd_none(pmdval) || pmd_trans_huge(pmdval) ||
+	    unlikely(pmd_bad(pmdval)))
+		goto fail;
+
+	ptl = pte_lockptr(mm, pmd);
+	pte = pte_offset_map(pmd, address);
+	if (!spin_trylock(ptl)) {
+		pte_unmap(pte);
+		goto fail;
+	}
+	if (read_seqcount_retry(&vma->vm_sequence, seq)) {
+		pte_unmap_unlock(pte, ptl);
+		goto fail;
+	}
+	*ptep = pte;
+	*ptlp = ptl;
+	return true;
+
+fail:
+	local_irq_enable();
+	return false;
+
+locked:
+#endif
+	*ptep = pte_offset_map_lock(mm, pmd, address, ptlp);
+	return true;
+}
+
+static inline void pte_unmap_unlock_fault(pte_t *pte, spinlock_t *ptl,
+					  unsigned int flags)
+{
+	pte_unmap_unlock(pte, ptl);
+	if (flags & FAULT_FLAG_SPECULATIVE)
+		local_irq_enable();
+}
+
+/*
+ * A speculative fault must not look at vma->vm_policy, which can change
+ * under it: allocate by the task's policy instead.
+ */
+static inline struct page *alloc_fault_page(struct vm_area_struct *vma,
+					    unsigned long address,
+					    unsigned int flags)
+{
+	if (flags & FAULT_FLAG_SPECULATIVE)
+		return alloc_page(GFP_HIGHUSER_MOVABLE);
+	return alloc_page_vma(GFP_HIGHUSER_MOVABLE, vma, address);
+}
+
 /*
  * We enter with non-exclusive mmap_sem (to exclude vma changes,
  * but allow concurrent faults), and pte mapped but not yet locked.
  * We return with mmap_sem still held, but pte unmapped and unlocked.
+ *
+ * For a speculative fault (seq is then the vma sequence count) there
+ * is no mmap_sem and VM_FAULT_RETRY is returned if the vma changed.
  */
 static int do_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		unsigned long address, pte_t *page_table, pmd_t *pmd,
-		unsigned int flags)
+		unsigned int flags, unsigned int seq)
 {
 	struct page *page;
 	spinlock_t *ptl;
@@ -3138,7 +3229,9 @@ static int do_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 	if (!(flags & FAULT_FLAG_WRITE)) {
 		entry = pte_mkspecial(pfn_pte(my_zero_pfn(address),
 						vma->vm_page_prot));
-		page_table = pte_offset_map_lock(mm, pmd, address, &ptl);
+		if (!pte_map_lock(mm, vma, address, pmd, flags, seq,
+				  &page_table, &ptl))
+			return VM_FAULT_RETRY;
 		if (!pte_none(*page_table))
 			goto unlock;
 		goto setpte;
@@ -3147,7 +3240,12 @@ static int do_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 	/* Allocate our own private page. */
 	if (unlikely(anon_vma_prepare(vma)))
 		goto oom;
-	page = alloc_zeroed_user_highpage_movable(vma, address);
+	if (flags & FAULT_FLAG_SPECULATIVE) {
+		page = alloc_fault_page(vma, address, flags);
+		if (page)
+			clear_user_highpage(page, address);
+	} else
+		page = alloc_zeroed_user_highpage_movable(vma, address);
 	if (!page)
 		goto oom;
 	__SetPageUptodate(page);
@@ -3159,7 +3257,12 @@ static int do_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 	if (vma->vm_flags & VM_WRITE)
 		entry = pte_mkwrite(pte_mkdirty(entry));
 
-	page_table = pte_offset_map_lock(mm, pmd, address, &ptl);
+	if (!pte_map_lock(mm, vma, address, pmd, flags, seq,
+			  &page_table, &ptl)) {
+		mem_cgroup_uncharge_page(page);
+		page_cache_release(page);
+		return VM_FAULT_RETRY;
+	}
 	if (!pte_none(*page_table))
 		goto release;
 
@@ -3171,7 +3274,7 @@ setpte:
 	/* No need to invalidate - it was non-present before */
 	update_mmu_cache(vma, address, page_table);
 unlock:
-	pte_unmap_unlock(page_table, ptl);
+	pte_unmap_unlock_fault(page_table, ptl, flags);
 	return 0;
 release:
 	mem_cgroup_uncharge_page(page);
@@ -3195,10 +3298,11 @@ oom:
  * We enter with non-exclusive mmap_sem (to exclude vma changes,
  * but allow concurrent faults), and pte neither mapped nor locked.
  * We return with mmap_sem still held, but pte unmapped and unlocked.
+ * A speculative fault is as for do_anonymous_page().
  */
 static int __do_fault(struct mm_struct *mm, struct vm_area_struct *vma,
-		unsigned long address, pmd_t *pmd,
-		pgoff_t pgoff, unsigned int flags, pte_t orig_pte)
+		unsigned long address, pmd_t *pmd, pgoff_t pgoff,
+		unsigned int flags, pte_t orig_pte, unsigned int seq)
 {
 	pte_t *page_table;
 	spinlock_t *ptl;
@@ -3220,7 +3324,7 @@ static int __do_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 		if (unlikely(anon_vma_prepare(vma)))
 			return VM_FAULT_OOM;
 
-		cow_page = alloc_page_vma(GFP_HIGHUSER_MOVABLE, vma, address);
+		cow_page = alloc_fault_page(vma, address, flags);
 		if (!cow_page)
 			return VM_FAULT_OOM;
 
@@ -3299,7 +3403,16 @@ static int __do_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 
 	}
 
-	page_table = pte_offset_map_lock(mm, pmd, address, &ptl);
+	if (!pte_map_lock(mm, vma, address, pmd, flags, seq,
+			  &page_table, &ptl)) {
+		if (anon) {
+			mem_cgroup_uncharge_page(cow_page);
+			page_cache_release(cow_page);
+		}
+		unlock_page(vmf.page);
+		page_cache_release(vmf.page);
+		return VM_FAULT_RETRY;
+	}
 
 	/*
 	 * This silly early PAGE_DIRTY setting removes a race
@@ -3341,7 +3454,7 @@ static int __do_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 			anon = 1; /* no anon but release faulted_page */
 	}
 
-	pte_unmap_unlock(page_table, ptl);
+	pte_unmap_unlock_fault(page_table, ptl, flags);
 
 	if (dirty_page) {
 		struct address_space *mapping = page->mapping;
@@ -3381,15 +3494,125 @@ uncharge_out:
 	return ret;
 }
 
+/*
+ * Map a page cache page read-only at address, for ->map_pages().
+ * The caller holds the pte lock and a reference on the page, which
+ * the new mapping takes over.
+ */
+void do_set_pte(struct vm_area_struct *vma, unsigned long address,
+		struct page *page, pte_t *pte)
+{
+	pte_t entry;
+
+	flush_icache_page(vma, page);
+	entry = mk_pte(page, vma->vm_page_prot);
+	inc_mm_counter_fast(vma->vm_mm, MM_FILEPAGES);
+	page_add_file_rmap(page);
+	set_pte_at(vma->vm_mm, address, pte, entry);
+
+	/* no need to invalidate: a not-present page won't be cached */
+	update_mmu_cache(vma, address, pte);
+}
+
+/* Window of cached pages mapped around a read fault, a power of two */
+static unsigned long fault_around_bytes = 65536;
+
+#ifdef CONFIG_DEBUG_FS
+static int fault_around_bytes_get(void *data, u64 *val)
+{
+	*val = fault_around_bytes;
+	return 0;
+}
+
+static int fault_around_bytes_set(void *data, u64 val)
+{
+	if (val / PAGE_SIZE > PTRS_PER_PTE)
+		return -EINVAL;
+	if (val > PAGE_SIZE)
+		fault_around_bytes = rounddown_pow_of_two(val);
+	else
+		fault_around_bytes = PAGE_SIZE; /* disables fault-around */
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(fault_around_bytes_fops,
+		fault_around_bytes_get, fault_around_bytes_set, "%llu\n");
+
+static int __init fault_around_debugfs(void)
+{
+	if (!debugfs_create_file("fault_around_bytes", 0644, NULL, NULL,
+				 &fault_around_bytes_fops))
+		pr_warning("Failed to create fault_around_bytes in debugfs\n");
+	return 0;
+}
+late_initcall(fault_around_debugfs);
+#endif
+
+/*
+ * Let ->map_pages() map the pages around address that are already in
+ * the page cache.  The window is aligned to its size and clamped to the
+ * vma and the page table of address, so that pte can be indexed from.
+ * Called with the pte lock held.
+ */
+static void do_fault_around(struct vm_area_struct *vma, unsigned long address,
+		pte_t *pte, pgoff_t pgoff, unsigned int flags)
+{
+	unsigned long start_addr, end_addr, nr_pages;
+	struct vm_fault vmf;
+	int off;
+
+	nr_pages = ACCESS_ONCE(fault_around_bytes) >> PAGE_SHIFT;
+
+	start_addr = max(address & ~(nr_pages * PAGE_SIZE - 1) & PAGE_MASK,
+			 vma->vm_start);
+	end_addr = min3(start_addr + nr_pages * PAGE_SIZE, vma->vm_end,
+			pmd_addr_end(address, vma->vm_end));
+	off = (address - start_addr) >> PAGE_SHIFT;
+	pte -= off;
+	pgoff -= off;
+
+	/* Skip what is already mapped: nothing to do if that is all */
+	while (!pte_none(*pte)) {
+		start_addr += PAGE_SIZE;
+		if (start_addr >= end_addr)
+			return;
+		pte++;
+		pgoff++;
+	}
+
+	vmf.virtual_address = (void __user *) start_addr;
+	vmf.pte = pte;
+	vmf.pgoff = pgoff;
+	vmf.max_pgoff = pgoff + ((end_addr - start_addr) >> PAGE_SHIFT) - 1;
+	vmf.flags = flags;
+	vma->vm_ops->map_pages(vma, &vmf);
+}
+
 static int do_linear_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 		unsigned long address, pte_t *page_table, pmd_t *pmd,
 		unsigned int flags, pte_t orig_pte)
 {
 	pgoff_t pgoff = (((address & PAGE_MASK)
 			- vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+	spinlock_t *ptl;
 
 	pte_unmap(page_table);
-	return __do_fault(mm, vma, address, pmd, pgoff, flags, orig_pte);
+
+	/*
+	 * On a read fault, first map whatever is cached around it: if
+	 * that covers address too, we're done without calling ->fault.
+	 */
+	if (!(flags & FAULT_FLAG_WRITE) && vma->vm_ops->map_pages &&
+	    fault_around_bytes >> PAGE_SHIFT > 1) {
+		page_table = pte_offset_map_lock(mm, pmd, address, &ptl);
+		do_fault_around(vma, address, page_table, pgoff, flags);
+		if (!pte_same(*page_table, orig_pte)) {
+			pte_unmap_unlock(page_table, ptl);
+			return 0;
+		}
+		pte_unmap_unlock(page_table, ptl);
+	}
+
+	return __do_fault(mm, vma, address, pmd, pgoff, flags, orig_pte, 0);
 }
 
 /*
@@ -3421,7 +3644,7 @@ static int do_nonlinear_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	}
 
 	pgoff = pte_to_pgoff(orig_pte);
-	return __do_fault(mm, vma, address, pmd, pgoff, flags, orig_pte);
+	return __do_fault(mm, vma, address, pmd, pgoff, flags, orig_pte, 0);
 }
 
 /*
@@ -3453,7 +3676,7 @@ int handle_pte_fault(struct mm_struct *mm,
 						pte, pmd, flags, entry);
 			}
 			return do_anonymous_page(mm, vma, address,
-						 pte, pmd, flags);
+						 pte, pmd, flags, 0);
 		}
 		if (pte_file(entry))
 			return do_nonlinear_fault(mm, vma, address,
@@ -3557,6 +3780,120 @@ int handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	return handle_pte_fault(mm, vma, address, pte, pmd, flags);
 }
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+/*
+ * Whether a fault on vma can be handled without mmap_sem: only private
+ * anonymous memory and page cache mappings qualify, and nothing that
+ * would need the vma modified (no anon_vma to set up, no stack growth).
+ */
+static bool vma_can_speculate(struct vm_area_struct *vma, unsigned int flags)
+{
+	unsigned long vm_flags = ACCESS_ONCE(vma->vm_flags);
+
+	if (flags & FAULT_FLAG_WRITE) {
+		if (!(vm_flags & VM_WRITE))
+			return false;
+	} else if (!(vm_flags & (VM_READ | VM_EXEC | VM_WRITE)))
+		return false;
+	if (vm_flags & (VM_HUGETLB | VM_PFNMAP | VM_MIXEDMAP | VM_IO |
+			VM_NONLINEAR | VM_GROWSDOWN | VM_GROWSUP))
+		return false;
+	if (vma_policy(vma))
+		return false;
+
+	if (!vma->vm_ops)
+		return !(flags & FAULT_FLAG_WRITE) || vma->anon_vma;
+
+	if (vma->vm_ops->fault != filemap_fault)
+		return false;
+	if (flags & FAULT_FLAG_WRITE)
+		return !(vm_flags & VM_SHARED) && vma->anon_vma;
+	return true;
+}
+
+/*
+ * Handle a fault on a not yet populated pte without taking mmap_sem.
+ * The vma is found under RCU and any change to it since is caught
+ * when the pte lock is taken, see pte_map_lock().  Returns
+ * VM_FAULT_RETRY if the fault has to go through handle_mm_fault()
+ * with mmap_sem held instead.
+ */
+int handle_speculative_fault(struct mm_struct *mm, unsigned long address,
+			     unsigned int flags)
+{
+	struct vm_area_struct *vma;
+	unsigned int seq;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd, pmdval;
+	pte_t *pte, entry;
+	int ret = VM_FAULT_RETRY;
+
+	flags &= ~(FAULT_FLAG_ALLOW_RETRY | FAULT_FLAG_RETRY_NOWAIT |
+		   FAULT_FLAG_KILLABLE);
+	flags |= FAULT_FLAG_SPECULATIVE;
+
+	vma = get_vma_speculative(mm, address, &seq);
+	if (!vma)
+		goto out;
+	if (!vma_can_speculate(vma, flags))
+		goto out_put;
+
+	/* Page tables are not freed while we have interrupts disabled */
+	local_irq_disable();
+	pgd = pgd_offset(mm, address);
+	if (pgd_none(*pgd) || unlikely(pgd_bad(*pgd)))
+		goto out_walk;
+	pud = pud_offset(pgd, address);
+	if (pud_none(*pud) || unlikely(pud_bad(*pud)))
+		goto out_walk;
+	pmd = pmd_offset(pud, address);
+	pmdval = *pmd;
+	barrier();
+	if (pmd_none(pmdval) || pmd_trans_huge(pmdval) ||
+	    unlikely(pmd_bad(pmdval)))
+		goto out_walk;
+	pte = pte_offset_map(pmd, address);
+	entry = *pte;
+	barrier();
+	if (!pte_none(entry)) {
+		pte_unmap(pte);
+		goto out_walk;
+	}
+	local_irq_enable();
+
+	__set_current_state(TASK_RUNNING);
+	check_sync_rss_stat(current);
+
+	if (!vma->vm_ops)
+		ret = do_anonymous_page(mm, vma, address, pte, pmd, flags, seq);
+	else {
+		pte_unmap(pte);
+		ret = __do_fault(mm, vma, address, pmd,
+				 linear_page_index(vma, address),
+				 flags, entry, seq);
+	}
+	put_vma(vma);
+
+	if (unlikely(ret & (VM_FAULT_ERROR | VM_FAULT_RETRY))) {
+		ret = VM_FAULT_RETRY;
+		goto out;
+	}
+	count_vm_event(PGFAULT);
+	mem_cgroup_count_vm_event(mm, PGFAULT);
+	count_vm_event(SPF_SUCCESS);
+	return ret;
+
+out_walk:
+	local_irq_enable();
+out_put:
+	put_vma(vma);
+out:
+	count_vm_event(SPF_FALLBACK);
+	return ret;
+}
+#endif
+
 #ifndef __PAGETABLE_PUD_FOLDED
 /*
  * Allocate page upper directory.
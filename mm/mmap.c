@@ -220,6 +220,37 @@ void unlink_file_vma(struct vm_area_struct *vma)
 	}
 }
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+static void __free_vma_rcu(struct rcu_head *head)
+{
+	struct vm_area_struct *vma;
+
+	vma = container_of(head, struct vm_area_struct, vm_rcu_head);
+	kmem_cache_free(vm_area_cachep, vma);
+}
+#endif
+
+/*
+ * Drop a reference to an unlinked vma, freeing it with the last one.
+ * Besides the mm, speculative page faults hold references; they may
+ * also still be looking at the vma under RCU.
+ */
+void put_vma(struct vm_area_struct *vma)
+{
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	if (!atomic_dec_and_test(&vma->vm_ref_count))
+		return;
+#endif
+	if (vma->vm_file)
+		fput(vma->vm_file);
+	mpol_put(vma_policy(vma));
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	call_rcu(&vma->vm_rcu_head, __free_vma_rcu);
+#else
+	kmem_cache_free(vm_area_cachep, vma);
+#endif
+}
+
 /*
  * Close a vm structure and free it, returning the next.
  */
@@ -230,13 +261,9 @@ static struct vm_area_struct *remove_vma(struct vm_area_struct *vma)
 	might_sleep();
 	if (vma->vm_ops && vma->vm_ops->close)
 		vma->vm_ops->close(vma);
-	if (vma->vm_file) {
-		fput(vma->vm_file);
-		if (vma->vm_flags & VM_EXECUTABLE)
-			removed_exe_file_vma(vma->vm_mm);
-	}
-	mpol_put(vma_policy(vma));
-	kmem_cache_free(vm_area_cachep, vma);
+	if (vma->vm_file && (vma->vm_flags & VM_EXECUTABLE))
+		removed_exe_file_vma(vma->vm_mm);
+	put_vma(vma);
 	return next;
 }
 
@@ -390,11 +417,37 @@ find_vma_prepare(struct mm_struct *mm, unsigned long addr,
 	return vma;
 }
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+static inline void mm_rb_write_begin(struct mm_struct *mm)
+{
+	write_seqcount_begin(&mm->mm_rb_seq);
+}
+
+static inline void mm_rb_write_end(struct mm_struct *mm)
+{
+	write_seqcount_end(&mm->mm_rb_seq);
+}
+#else
+static inline void mm_rb_write_begin(struct mm_struct *mm)
+{
+}
+
+static inline void mm_rb_write_end(struct mm_struct *mm)
+{
+}
+#endif
+
 void __vma_link_rb(struct mm_struct *mm, struct vm_area_struct *vma,
 		struct rb_node **rb_link, struct rb_node *rb_parent)
 {
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	seqcount_init(&vma->vm_sequence);
+	atomic_set(&vma->vm_ref_count, 1);
+#endif
+	mm_rb_write_begin(mm);
 	rb_link_node(&vma->vm_rb, rb_parent, rb_link);
 	rb_insert_color(&vma->vm_rb, &mm->mm_rb);
+	mm_rb_write_end(mm);
 }
 
 static void __vma_link_file(struct vm_area_struct *vma)
@@ -475,7 +528,9 @@ __vma_unlink(struct mm_struct *mm, struct vm_area_struct *vma,
 	prev->vm_next = next;
 	if (next)
 		next->vm_prev = prev;
+	mm_rb_write_begin(mm);
 	rb_erase(&vma->vm_rb, &mm->mm_rb);
+	mm_rb_write_end(mm);
 	if (mm->mmap_cache == vma)
 		mm->mmap_cache = prev;
 }
@@ -500,6 +555,7 @@ int vma_adjust(struct vm_area_struct *vma, unsigned long start,
 	long adjust_next = 0;
 	int remove_next = 0;
 
+	vm_write_begin(vma);
 	if (next && !insert) {
 		struct vm_area_struct *exporter = NULL;
 
@@ -537,12 +593,17 @@ again:			remove_next = 1 + (end > next->vm_end);
 		 * shrinking vma had, to cover any anon pages imported.
 		 */
 		if (exporter && exporter->anon_vma && !importer->anon_vma) {
-			if (anon_vma_clone(importer, exporter))
+			if (anon_vma_clone(importer, exporter)) {
+				vm_write_end(vma);
 				return -ENOMEM;
+			}
 			importer->anon_vma = exporter->anon_vma;
 		}
 	}
 
+	if (next)
+		vm_write_begin(next);
+
 	if (file) {
 		mapping = file->f_mapping;
 		if (!(vma->vm_flags & VM_NONLINEAR))
@@ -617,16 +678,13 @@ again:			remove_next = 1 + (end > next->vm_end);
 		mutex_unlock(&mapping->i_mmap_mutex);
 
 	if (remove_next) {
-		if (file) {
-			fput(file);
-			if (next->vm_flags & VM_EXECUTABLE)
-				removed_exe_file_vma(mm);
-		}
+		/* next's sequence is left odd, it is gone for good */
+		if (file && (next->vm_flags & VM_EXECUTABLE))
+			removed_exe_file_vma(mm);
 		if (next->anon_vma)
 			anon_vma_merge(vma, next);
 		mm->map_count--;
-		mpol_put(vma_policy(next));
-		kmem_cache_free(vm_area_cachep, next);
+		put_vma(next);
 		/*
 		 * In mprotect's case 6 (see comments on vma_merge),
 		 * we must remove another next too. It would clutter
@@ -636,7 +694,9 @@ again:			remove_next = 1 + (end > next->vm_end);
 			next = vma->vm_next;
 			goto again;
 		}
-	}
+	} else if (next)
+		vm_write_end(next);
+	vm_write_end(vma);
 
 	validate_mm(mm);
 
@@ -1603,6 +1663,61 @@ struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr)
 
 EXPORT_SYMBOL(find_vma);
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+/*
+ * Look up the vma containing addr without mmap_sem, for the speculative
+ * page fault.  On success a reference is held on the vma, to be dropped
+ * with put_vma(), and *seq is the vma sequence count to validate any
+ * later result against.  Returns NULL if the lookup raced with a writer:
+ * the caller then takes the slow path.
+ */
+struct vm_area_struct *get_vma_speculative(struct mm_struct *mm,
+					   unsigned long addr, unsigned int *seq)
+{
+	struct vm_area_struct *vma = NULL;
+	struct rb_node *rb_node;
+	unsigned int rb_seq;
+	int depth = 0;
+
+	rcu_read_lock();
+	rb_seq = read_seqcount_begin(&mm->mm_rb_seq);
+	rb_node = ACCESS_ONCE(mm->mm_rb.rb_node);
+	while (rb_node) {
+		struct vm_area_struct *vma_tmp;
+
+		/* A concurrent rotation could send us round in circles */
+		if (++depth > 64)
+			goto out_unlock;
+		vma_tmp = rb_entry(rb_node, struct vm_area_struct, vm_rb);
+		if (vma_tmp->vm_end > addr) {
+			if (vma_tmp->vm_start <= addr) {
+				vma = vma_tmp;
+				break;
+			}
+			rb_node = ACCESS_ONCE(rb_node->rb_left);
+		} else
+			rb_node = ACCESS_ONCE(rb_node->rb_right);
+	}
+	if (!vma || read_seqcount_retry(&mm->mm_rb_seq, rb_seq))
+		goto out_fail;
+
+	*seq = ACCESS_ONCE(vma->vm_sequence.sequence);
+	smp_rmb();
+	if ((*seq & 1) || addr < vma->vm_start || addr >= vma->vm_end)
+		goto out_fail;
+	if (!atomic_inc_not_zero(&vma->vm_ref_count))
+		goto out_fail;
+	rcu_read_unlock();
+	return vma;
+
+out_fail:
+	vma = NULL;
+out_unlock:
+	rcu_read_unlock();
+	return vma;
+}
+#endif
+
 /* Same as find_vma, but also return a pointer to the previous VMA in *pprev. */
 struct vm_area_struct *
 find_vma_prev(struct mm_struct *mm, unsigned long addr,
@@ -1904,12 +2019,16 @@ detach_vmas_to_be_unmapped(struct mm_struct *mm, struct vm_area_struct *vma,
 
 	insertion_point = (prev ? &prev->vm_next : &mm->mmap);
 	vma->vm_prev = NULL;
+	mm_rb_write_begin(mm);
 	do {
+		/* Left odd: the vma is gone for speculative faults */
+		vm_write_begin(vma);
 		rb_erase(&vma->vm_rb, &mm->mm_rb);
 		mm->map_count--;
 		tail_vma = vma;
 		vma = vma->vm_next;
 	} while (vma && vma->vm_start < end);
+	mm_rb_write_end(mm);
 	*insertion_point = vma;
 	if (vma)
 		vma->vm_prev = prev;
@@ -90,7 +90,7 @@ static inline void change_pmd_range(struct vm_area_struct *vma, pud_t *pud,
 		next = pmd_addr_end(addr, end);
 		if (pmd_trans_huge(*pmd)) {
 			if (next - addr != HPAGE_PMD_SIZE)
-				split_huge_page_pmd(vma->vm_mm, pmd);
+				split_huge_page_pmd(vma->vm_mm, addr, pmd);
 			else if (change_huge_pmd(vma, pmd, addr, newprot))
 				continue;
 			/* fall through */
@@ -203,8 +203,10 @@ mprotect_fixup(struct vm_area_struct *vma, struct vm_area_struct **pprev,
 success:
 	/*
 	 * vm_flags and vm_page_prot are protected by the mmap_sem
-	 * held in write mode.
+	 * held in write mode, and the vma sequence count against
+	 * speculative page faults.
 	 */
+	vm_write_begin(vma);
 	vma->vm_flags = newflags;
 	protflags = newflags;
 #ifdef CONFIG_IPIPE
@@ -222,6 +224,7 @@ success:
 		vma->vm_page_prot = vm_get_page_prot(newflags & ~VM_SHARED);
 		dirty_accountable = 1;
 	}
+	vm_write_end(vma);
 
 	mmu_notifier_invalidate_range_start(mm, start, end);
 #ifdef CONFIG_IPIPE
@@ -1219,6 +1219,24 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 	} else if (PageAnon(page)) {
 		swp_entry_t entry = { .val = page_private(page) };
 
+		if ((flags & TTU_LAZYFREE) && !PageSwapCache(page)) {
+			/*
+			 * A page given up with MADV_FREE is simply dropped,
+			 * unless it has been written to since or somebody
+			 * other than its mappings and reclaim holds it.
+			 * Then it has to stay and be swapped as usual.
+			 */
+			smp_mb();
+			if (!PageDirty(page) &&
+			    page_count(page) == 1 + page_mapcount(page)) {
+				dec_mm_counter(mm, MM_ANONPAGES);
+				goto discard;
+			}
+			set_pte_at(mm, address, pte, pteval);
+			ClearPageLazyFree(page);
+			ret = SWAP_FAIL;
+			goto out_unmap;
+		}
 		if (PageSwapCache(page)) {
 			/*
 			 * Store the swap location in the pte.
@@ -1256,6 +1274,7 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 	} else
 		dec_mm_counter(mm, MM_FILEPAGES);
 
+discard:
 	page_remove_rmap(page);
 	page_cache_release(page);
 
@@ -29,6 +29,7 @@
 #include <linux/pagevec.h>
 #include <linux/backing-dev.h>
 #include <linux/rmap.h>
+#include <linux/ksm.h>
 #include <linux/topology.h>
 #include <linux/cpu.h>
 #include <linux/cpuset.h>
@@ -826,6 +827,35 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 			; /* try to reclaim the page below */
 		}
 
+		/*
+		 * Anonymous memory given up with MADV_FREE needs no swap:
+		 * drop it, unless it was written to again in the meantime.
+		 */
+		if (PageAnon(page) && PageLazyFree(page) &&
+		    !PageSwapCache(page) && !PageKsm(page)) {
+			if (page_mapped(page)) {
+				switch (try_to_unmap(page,
+						     TTU_UNMAP | TTU_LAZYFREE)) {
+				case SWAP_FAIL:
+					goto activate_locked;
+				case SWAP_AGAIN:
+					goto keep_locked;
+				case SWAP_MLOCK:
+					goto cull_mlocked;
+				case SWAP_SUCCESS:
+					; /* try to free the page below */
+				}
+			}
+			if (!PageDirty(page)) {
+				if (!page_freeze_refs(page, 1))
+					goto keep_locked;
+				count_vm_event(PGLAZYFREED);
+				__clear_page_locked(page);
+				goto free_it;
+			}
+			ClearPageLazyFree(page);
+		}
+
 		/*
 		 * Anonymous process memory has backing store?
 		 * Try to allocate it some swap space here.
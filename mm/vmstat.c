@@ -756,6 +756,7 @@ const char * const vmstat_text[] = {
 	"allocstall",
 
 	"pgrotated",
+	"pglazyfreed",
 
 #ifdef CONFIG_COMPACTION
 	"compact_blocks_moved",
@@ -785,6 +786,13 @@ const char * const vmstat_text[] = {
 	"thp_collapse_alloc",
 	"thp_collapse_alloc_failed",
 	"thp_split",
+	"thp_fault_zero",
+	"thp_zero_page_alloc",
+	"thp_zero_page_alloc_failed",
+#endif
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	"speculative_pgfault",
+	"speculative_pgfault_fallback",
 #endif
 
 #endif /* CONFIG_VM_EVENTS_COUNTERS */
@@ -56,6 +56,7 @@
 #include <net/checksum.h>
 #include <net/sock.h>
 #include <net/tcp_states.h>
+#include <net/busy_poll.h>
 #include <trace/events/skb.h>
 
 /*
@@ -157,8 +158,9 @@ out_noerr:
  *	quite explicitly by POSIX 1003.1g, don't change them without having
  *	the standard around please.
  */
-struct sk_buff *__skb_recv_datagram(struct sock *sk, unsigned flags,
-				    int *peeked, int *err)
+static struct sk_buff *___skb_recv_datagram(struct sock *sk, unsigned flags,
+					    int *peeked, int *err,
+					    struct skb_batch *batch)
 {
 	struct sk_buff *skb;
 	long timeo;
@@ -188,14 +190,26 @@ struct sk_buff *__skb_recv_datagram(struct sock *sk, unsigned flags,
 			if (flags & MSG_PEEK) {
 				skb->peeked = 1;
 				atomic_inc(&skb->users);
-			} else
+			} else {
 				__skb_unlink(skb, &sk->sk_receive_queue);
+				/* Take what follows while we hold the lock */
+				while (batch && batch->budget &&
+				       !skb_queue_empty(&sk->sk_receive_queue)) {
+					__skb_queue_tail(&batch->queue,
+						__skb_dequeue(&sk->sk_receive_queue));
+					batch->budget--;
+				}
+			}
 		}
 		spin_unlock_irqrestore(&sk->sk_receive_queue.lock, cpu_flags);
 
 		if (skb)
 			return skb;
 
+		if (sk_can_busy_loop(sk) &&
+		    sk_busy_loop(sk, flags & MSG_DONTWAIT))
+			continue;
+
 		/* User doesn't want to wait */
 		error = -EAGAIN;
 		if (!timeo)
@@ -209,8 +223,54 @@ no_packet:
 	*err = error;
 	return NULL;
 }
+
+struct sk_buff *__skb_recv_datagram(struct sock *sk, unsigned flags,
+				    int *peeked, int *err)
+{
+	return ___skb_recv_datagram(sk, flags, peeked, err, NULL);
+}
 EXPORT_SYMBOL(__skb_recv_datagram);
 
+/**
+ *	skb_recv_datagram_batch - Receive a datagram skbuff for recvmmsg()
+ *	@sk: socket
+ *	@batch: datagrams already taken off the receive queue, may be %NULL
+ *	@flags: MSG_ flags
+ *	@peeked: returns non-zero if this packet has been seen before
+ *	@err: error code returned
+ *
+ *	Same as __skb_recv_datagram(), but when @batch is empty the datagrams
+ *	queued behind the returned one are moved to @batch (up to its budget)
+ *	under the same hold of the receive queue lock, and later calls are
+ *	served from @batch without touching sk_receive_queue.  Datagrams left
+ *	in @batch must be given back with skb_batch_release().
+ *
+ *	While parked on @batch, datagrams are hidden from other readers of
+ *	the socket and from poll().  Since only the oldest datagrams are ever
+ *	parked, and they are served first and put back at the head of the
+ *	queue, the order seen by the caller and by later readers is the
+ *	order of arrival; a concurrent reader may however be handed newer
+ *	datagrams while older ones sit in @batch.
+ */
+struct sk_buff *skb_recv_datagram_batch(struct sock *sk,
+					struct skb_batch *batch,
+					unsigned flags, int *peeked, int *err)
+{
+	struct sk_buff *skb;
+
+	if (!batch || (flags & MSG_PEEK))
+		return __skb_recv_datagram(sk, flags, peeked, err);
+
+	skb = __skb_dequeue(&batch->queue);
+	if (skb) {
+		*peeked = skb->peeked;
+		return skb;
+	}
+
+	return ___skb_recv_datagram(sk, flags, peeked, err, batch);
+}
+EXPORT_SYMBOL(skb_recv_datagram_batch);
+
 struct sk_buff *skb_recv_datagram(struct sock *sk, unsigned flags,
 				  int noblock, int *err)
 {
@@ -248,6 +308,74 @@ void skb_free_datagram_locked(struct sock *sk, struct sk_buff *skb)
 }
 EXPORT_SYMBOL(skb_free_datagram_locked);
 
+/**
+ *	skb_free_datagram_batch - Free a datagram received for recvmmsg()
+ *	@sk: socket
+ *	@batch: batch the datagram was received with, may be %NULL
+ *	@skb: datagram skbuff
+ *
+ *	Without a batch this is skb_free_datagram_locked().  Otherwise the
+ *	skbuff is parked on @batch so that skb_batch_release() can give back
+ *	the receive memory of the whole batch under a single socket lock.
+ */
+void skb_free_datagram_batch(struct sock *sk, struct skb_batch *batch,
+			     struct sk_buff *skb)
+{
+	if (!batch) {
+		skb_free_datagram_locked(sk, skb);
+		return;
+	}
+
+	if (likely(atomic_read(&skb->users) == 1))
+		smp_rmb();
+	else if (likely(!atomic_dec_and_test(&skb->users)))
+		return;
+
+	__skb_queue_tail(&batch->done, skb);
+}
+EXPORT_SYMBOL(skb_free_datagram_batch);
+
+/**
+ *	skb_batch_release - Finish a recvmmsg() batch
+ *	@sk: socket
+ *	@batch: batch to release
+ *
+ *	Put the datagrams that were dequeued but not consumed back at the
+ *	head of the receive queue, in order and ahead of anything queued
+ *	since they were taken, and wake up readers that may have gone to
+ *	sleep while they were parked.  Then free the consumed ones,
+ *	uncharging their memory from the socket in one go.
+ */
+void skb_batch_release(struct sock *sk, struct skb_batch *batch)
+{
+	struct sk_buff *skb;
+	unsigned long cpu_flags;
+	bool slow;
+
+	if (!skb_queue_empty(&batch->queue)) {
+		spin_lock_irqsave(&sk->sk_receive_queue.lock, cpu_flags);
+		skb_queue_splice_init(&batch->queue, &sk->sk_receive_queue);
+		spin_unlock_irqrestore(&sk->sk_receive_queue.lock, cpu_flags);
+		sk->sk_data_ready(sk, 0);
+	}
+
+	if (skb_queue_empty(&batch->done))
+		return;
+
+	slow = lock_sock_fast(sk);
+	skb_queue_walk(&batch->done, skb)
+		skb_orphan(skb);
+	sk_mem_reclaim_partial(sk);
+	unlock_sock_fast(sk, slow);
+
+	/* skbs are now orphaned, can be freed outside of locked section */
+	while ((skb = __skb_dequeue(&batch->done)) != NULL) {
+		trace_kfree_skb(skb, skb_batch_release);
+		__kfree_skb(skb);
+	}
+}
+EXPORT_SYMBOL(skb_batch_release);
+
 /**
  *	skb_kill_datagram - Free a datagram skbuff forcibly
  *	@sk: socket
@@ -558,6 +686,78 @@ fault:
 }
 EXPORT_SYMBOL(skb_copy_datagram_from_iovec);
 
+/**
+ *	skb_zerocopy_add_iovec - Pin user pages into a buffer's page frags
+ *	@skb: buffer to append to
+ *	@iov: io vector holding the data
+ *	@offset: offset in the io vector to start at
+ *	@len: amount of data to map
+ *
+ *	Instead of copying, pin the user pages backing @len bytes of @iov
+ *	and append them to @skb as page fragments, extending the last
+ *	fragment where the data continues the same page. The caller must
+ *	attach a zerocopy buffer to @skb so the sender learns when the
+ *	pages are released.
+ *
+ *	Returns the number of bytes added, which may be short if @skb runs
+ *	out of fragments, -EMSGSIZE if there was no room at all or -EFAULT
+ *	if the user memory could not be pinned.
+ */
+int skb_zerocopy_add_iovec(struct sk_buff *skb, const struct iovec *iov,
+			   int offset, int len)
+{
+	int added = 0;
+
+	while (len > 0) {
+		unsigned long base;
+		size_t left;
+
+		/* Skip over iovecs already consumed */
+		if (offset >= iov->iov_len) {
+			offset -= iov->iov_len;
+			iov++;
+			continue;
+		}
+
+		base = (unsigned long)iov->iov_base + offset;
+		left = min_t(size_t, len, iov->iov_len - offset);
+
+		while (left) {
+			int i = skb_shinfo(skb)->nr_frags;
+			int off = base & ~PAGE_MASK;
+			int size = min_t(size_t, left, PAGE_SIZE - off);
+			struct page *page;
+
+			if (get_user_pages_fast(base, 1, 0, &page) != 1)
+				return added ? : -EFAULT;
+
+			if (skb_can_coalesce(skb, i, page, off)) {
+				skb_frag_size_add(&skb_shinfo(skb)->frags[i - 1],
+						  size);
+				put_page(page);
+			} else if (i < MAX_SKB_FRAGS) {
+				skb_fill_page_desc(skb, i, page, off, size);
+			} else {
+				put_page(page);
+				return added ? : -EMSGSIZE;
+			}
+
+			skb->len += size;
+			skb->data_len += size;
+			skb->truesize += size;
+
+			added += size;
+			base += size;
+			left -= size;
+			offset += size;
+			len -= size;
+		}
+	}
+
+	return added;
+}
+EXPORT_SYMBOL(skb_zerocopy_add_iovec);
+
 static int skb_copy_and_csum_datagram(const struct sk_buff *skb, int offset,
 				      u8 __user *to, int len,
 				      __wsum *csump)
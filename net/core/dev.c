@@ -137,6 +137,7 @@
 #include <linux/if_pppox.h>
 #include <linux/ppp_defs.h>
 #include <linux/net_tstamp.h>
+#include <net/busy_poll.h>
 
 #include "net-sysfs.h"
 
@@ -2079,25 +2080,6 @@ static int dev_gso_segment(struct sk_buff *skb, int features)
 	return 0;
 }
 
-/*
- * Try to orphan skb early, right before transmission by the device.
- * We cannot orphan skb if tx timestamp is requested or the sk-reference
- * is needed on driver level for other reasons, e.g. see net/can/raw.c
- */
-static inline void skb_orphan_try(struct sk_buff *skb)
-{
-	struct sock *sk = skb->sk;
-
-	if (sk && !skb_shinfo(skb)->tx_flags) {
-		/* skb_tx_hash() wont be able to get sk.
-		 * We copy sk_hash into skb->rxhash
-		 */
-		if (!skb->rxhash)
-			skb->rxhash = sk->sk_hash;
-		skb_orphan(skb);
-	}
-}
-
 static bool can_checksum_protocol(unsigned long features, __be16 protocol)
 {
 	return ((features & NETIF_F_GEN_CSUM) ||
@@ -2145,23 +2127,6 @@ u32 netif_skb_features(struct sk_buff *skb)
 }
 EXPORT_SYMBOL(netif_skb_features);
 
-/*
- * Returns true if either:
- *	1. skb has frag_list and the device doesn't support FRAGLIST, or
- *	2. skb is fragmented and the device does not support SG, or if
- *	   at least one of fragments is in highmem and device does not
- *	   support DMA from it.
- */
-static inline int skb_needs_linearize(struct sk_buff *skb,
-				      int features)
-{
-	return skb_is_nonlinear(skb) &&
-			((skb_has_frag_list(skb) &&
-				!(features & NETIF_F_FRAGLIST)) ||
-			(skb_shinfo(skb)->nr_frags &&
-				!(features & NETIF_F_SG)));
-}
-
 int dev_hard_start_xmit(struct sk_buff *skb, struct net_device *dev,
 			struct netdev_queue *txq)
 {
@@ -2182,8 +2147,6 @@ int dev_hard_start_xmit(struct sk_buff *skb, struct net_device *dev,
 		if (!list_empty(&ptype_all))
 			dev_queue_xmit_nit(skb, dev);
 
-		skb_orphan_try(skb);
-
 		features = netif_skb_features(skb);
 
 		if (vlan_tx_tag_present(skb) &&
@@ -2251,7 +2214,7 @@ gso:
 			return rc;
 		}
 		txq_trans_update(txq);
-		if (unlikely(netif_tx_queue_stopped(txq) && skb->next))
+		if (unlikely(netif_xmit_stopped(txq) && skb->next))
 			return NETDEV_TX_BUSY;
 	} while (skb->next);
 
@@ -2525,7 +2488,7 @@ int dev_queue_xmit(struct sk_buff *skb)
 
 			HARD_TX_LOCK(dev, txq, cpu);
 
-			if (!netif_tx_queue_stopped(txq)) {
+			if (!netif_xmit_stopped(txq)) {
 				__this_cpu_inc(xmit_recursion);
 				rc = dev_hard_start_xmit(skb, dev, txq);
 				__this_cpu_dec(xmit_recursion);
@@ -3234,8 +3197,6 @@ static int __netif_receive_skb(struct sk_buff *skb)
 	if (netpoll_receive_skb(skb))
 		return NET_RX_DROP;
 
-	if (!skb->skb_iif)
-		skb->skb_iif = skb->dev->ifindex;
 	orig_dev = skb->dev;
 
 	skb_reset_network_header(skb);
@@ -3247,6 +3208,10 @@ static int __netif_receive_skb(struct sk_buff *skb)
 	rcu_read_lock();
 
 another_round:
+	/* Track the device the packet is on now; input routes shared
+	 * through a FIB nexthop no longer record it.
+	 */
+	skb->skb_iif = skb->dev->ifindex;
 
 	__this_cpu_inc(softnet_data.processed);
 
@@ -3620,6 +3585,7 @@ EXPORT_SYMBOL(skb_gro_reset_offset);
 gro_result_t napi_gro_receive(struct napi_struct *napi, struct sk_buff *skb)
 {
 	skb_gro_reset_offset(skb);
+	skb_mark_napi_id(skb, napi);
 
 	return napi_skb_finish(__napi_gro_receive(napi, skb), skb);
 }
@@ -3721,6 +3687,8 @@ gro_result_t napi_gro_frags(struct napi_struct *napi)
 	if (!skb)
 		return GRO_DROP;
 
+	skb_mark_napi_id(skb, napi);
+
 	return napi_frags_finish(napi, skb, __napi_gro_receive(napi, skb));
 }
 EXPORT_SYMBOL(napi_gro_frags);
@@ -3831,7 +3799,8 @@ void __napi_complete(struct napi_struct *n)
 	BUG_ON(!test_bit(NAPI_STATE_SCHED, &n->state));
 	BUG_ON(n->gro_list);
 
-	list_del(&n->poll_list);
+	/* A busy polled instance is not on any poll list */
+	list_del_init(&n->poll_list);
 	smp_mb__before_clear_bit();
 	clear_bit(NAPI_STATE_SCHED, &n->state);
 }
@@ -3855,6 +3824,168 @@ void napi_complete(struct napi_struct *n)
 }
 EXPORT_SYMBOL(napi_complete);
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+/*
+ * Every NAPI context gets a non zero id, which is recorded in the skbs
+ * it delivers and from there in the receiving socket, so that a reader
+ * can find the context to busy poll.  Ids are looked up under RCU.
+ */
+#define NAPI_HASH_BITS	8
+#define NAPI_HASH_SIZE	(1 << NAPI_HASH_BITS)
+
+static struct hlist_head napi_hash[NAPI_HASH_SIZE];
+static DEFINE_SPINLOCK(napi_hash_lock);
+static unsigned int napi_gen_id = 1;
+
+static inline struct hlist_head *napi_hash_bucket(unsigned int napi_id)
+{
+	return &napi_hash[hash_32(napi_id, NAPI_HASH_BITS)];
+}
+
+/* must be called under rcu_read_lock() or napi_hash_lock */
+static struct napi_struct *napi_by_id(unsigned int napi_id)
+{
+	struct napi_struct *napi;
+	struct hlist_node *node;
+
+	hlist_for_each_entry_rcu(napi, node, napi_hash_bucket(napi_id),
+				 napi_hash_node)
+		if (napi->napi_id == napi_id)
+			return napi;
+
+	return NULL;
+}
+
+static void napi_hash_add(struct napi_struct *napi)
+{
+	spin_lock(&napi_hash_lock);
+
+	/* 0 means "no napi" for skbs and sockets, skip it and ids in use */
+	do {
+		if (unlikely(++napi_gen_id == 0))
+			napi_gen_id = 1;
+	} while (napi_by_id(napi_gen_id));
+
+	napi->napi_id = napi_gen_id;
+	hlist_add_head_rcu(&napi->napi_hash_node,
+			   napi_hash_bucket(napi->napi_id));
+
+	spin_unlock(&napi_hash_lock);
+}
+
+/* Caller must wait for a grace period before freeing the napi_struct */
+static bool napi_hash_del(struct napi_struct *napi)
+{
+	bool hashed;
+
+	spin_lock(&napi_hash_lock);
+	hashed = !hlist_unhashed(&napi->napi_hash_node);
+	if (hashed)
+		hlist_del_init_rcu(&napi->napi_hash_node);
+	spin_unlock(&napi_hash_lock);
+
+	return hashed;
+}
+
+/**
+ * napi_busy_loop - poll a NAPI context from process context
+ * @napi_id: id of the context, as recorded by skb_mark_napi_id()
+ * @end_time: busy_loop_us_clock() value at which to give up
+ * @loop_end: returns true once the caller has what it is waiting for
+ * @arg: argument passed to @loop_end
+ *
+ * Runs the driver's ->poll() handler directly instead of waiting for
+ * the interrupt to schedule it, as long as nobody else owns the context.
+ * Returns the number of packets the driver handed to the stack.
+ */
+int napi_busy_loop(unsigned int napi_id, unsigned long end_time,
+		   bool (*loop_end)(void *arg), void *arg)
+{
+	struct napi_struct *napi;
+	int work = 0;
+
+	rcu_read_lock();
+
+	napi = napi_by_id(napi_id);
+	if (!napi)
+		goto out;
+
+	do {
+		int rc = 0;
+
+		local_bh_disable();
+		if (napi_schedule_prep(napi)) {
+			void *have = netpoll_poll_lock(napi);
+
+			rc = napi->poll(napi, BUSY_POLL_BUDGET);
+			trace_napi_poll(napi);
+			if (rc == BUSY_POLL_BUDGET) {
+				/* The driver did not complete, it is still
+				 * ours: hand it back to net_rx_action().
+				 */
+				napi_gro_flush(napi);
+				local_irq_disable();
+				____napi_schedule(&__get_cpu_var(softnet_data),
+						  napi);
+				local_irq_enable();
+			}
+			netpoll_poll_unlock(have);
+		}
+		if (rc > 0) {
+			NET_ADD_STATS_BH(dev_net(napi->dev),
+					 LINUX_MIB_BUSYPOLLRXPACKETS, rc);
+			work += rc;
+		}
+		local_bh_enable();
+
+		if (loop_end(arg))
+			break;
+	} while (!busy_loop_timeout(end_time) && !need_resched() &&
+		 !signal_pending(current));
+
+out:
+	rcu_read_unlock();
+	return work;
+}
+EXPORT_SYMBOL(napi_busy_loop);
+
+static bool sk_busy_loop_end(void *arg)
+{
+	struct sock *sk = arg;
+
+	return !skb_queue_empty(&sk->sk_receive_queue);
+}
+
+/**
+ * sk_busy_loop - busy poll for data on a socket
+ * @sk: socket with a non zero sk_ll_usec
+ * @nonblock: only poll once
+ *
+ * Returns true if data showed up on the receive queue.
+ */
+bool sk_busy_loop(struct sock *sk, int nonblock)
+{
+	unsigned long end_time = nonblock ? 0 : sk_busy_loop_end_time(sk);
+
+	napi_busy_loop(sk->sk_napi_id, end_time, sk_busy_loop_end, sk);
+
+	return sk_busy_loop_end(sk);
+}
+EXPORT_SYMBOL(sk_busy_loop);
+
+#else /* CONFIG_NET_RX_BUSY_POLL */
+
+static inline void napi_hash_add(struct napi_struct *napi)
+{
+}
+
+static inline bool napi_hash_del(struct napi_struct *napi)
+{
+	return false;
+}
+
+#endif /* CONFIG_NET_RX_BUSY_POLL */
+
 void netif_napi_add(struct net_device *dev, struct napi_struct *napi,
 		    int (*poll)(struct napi_struct *, int), int weight)
 {
@@ -3871,6 +4002,7 @@ void netif_napi_add(struct net_device *dev, struct napi_struct *napi,
 	napi->poll_owner = -1;
 #endif
 	set_bit(NAPI_STATE_SCHED, &napi->state);
+	napi_hash_add(napi);
 }
 EXPORT_SYMBOL(netif_napi_add);
 
@@ -3878,6 +4010,10 @@ void netif_napi_del(struct napi_struct *napi)
 {
 	struct sk_buff *skb, *next;
 
+	/* busy pollers find the napi_struct by id under RCU */
+	if (napi_hash_del(napi))
+		synchronize_net();
+
 	list_del_init(&napi->dev_list);
 	napi_free_frags(napi);
 
@@ -5524,6 +5660,9 @@ static void netdev_init_one_queue(struct net_device *dev,
 	queue->xmit_lock_owner = -1;
 	netdev_queue_numa_node_write(queue, NUMA_NO_NODE);
 	queue->dev = dev;
+#ifdef CONFIG_BQL
+	dql_init(&queue->dql, HZ);
+#endif
 }
 
 static int netif_alloc_netdev_queues(struct net_device *dev)
@@ -132,6 +132,23 @@ u32 secure_ipv4_port_ephemeral(__be32 saddr, __be32 daddr, __be16 dport)
 	return hash[0];
 }
 EXPORT_SYMBOL_GPL(secure_ipv4_port_ephemeral);
+
+/* TCP Fast Open cookie: a MAC of the client address, keyed by net_secret
+ * so that only this host can mint cookies it will later accept.
+ */
+u64 secure_tcp_fastopen_cookie(__be32 saddr, __be32 daddr)
+{
+	u32 hash[MD5_DIGEST_WORDS];
+
+	hash[0] = (__force u32)saddr;
+	hash[1] = (__force u32)daddr;
+	hash[2] = net_secret[12];
+	hash[3] = net_secret[13];
+
+	md5_transform(hash, net_secret);
+
+	return hash[0] | (((u64)hash[1]) << 32);
+}
 #endif
 
 #if defined(CONFIG_IP_DCCP) || defined(CONFIG_IP_DCCP_MODULE)
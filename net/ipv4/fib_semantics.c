@@ -141,6 +141,28 @@ const struct fib_prop fib_props[RTN_MAX + 1] = {
 	},
 };
 
+static void rt_nexthop_free(struct rtable __rcu **rtp)
+{
+	struct rtable *rt = xchg((__force struct rtable **)rtp, NULL);
+
+	if (rt)
+		call_rcu(&rt->dst.rcu_head, dst_rcu_free);
+}
+
+/* Drop the routes cached on a nexthop; users still holding them keep
+ * them alive until they notice the route generation changed.
+ */
+static void fib_nh_flush_routes(struct fib_nh *nh)
+{
+	int cpu;
+
+	rt_nexthop_free(&nh->nh_rth_input);
+	if (!nh->nh_pcpu_rth_output)
+		return;
+	for_each_possible_cpu(cpu)
+		rt_nexthop_free(per_cpu_ptr(nh->nh_pcpu_rth_output, cpu));
+}
+
 /* Release a nexthop info record */
 static void free_fib_info_rcu(struct rcu_head *head)
 {
@@ -149,6 +171,8 @@ static void free_fib_info_rcu(struct rcu_head *head)
 	change_nexthops(fi) {
 		if (nexthop_nh->nh_dev)
 			dev_put(nexthop_nh->nh_dev);
+		fib_nh_flush_routes(nexthop_nh);
+		free_percpu(nexthop_nh->nh_pcpu_rth_output);
 	} endfor_nexthops(fi);
 
 	release_net(fi->fib_net);
@@ -180,6 +204,9 @@ void fib_release_info(struct fib_info *fi)
 			hlist_del(&nexthop_nh->nh_hash);
 		} endfor_nexthops(fi)
 		fi->fib_dead = 1;
+		change_nexthops(fi) {
+			fib_nh_flush_routes(nexthop_nh);
+		} endfor_nexthops(fi)
 		fib_info_put(fi);
 	}
 	spin_unlock_bh(&fib_info_lock);
@@ -770,6 +797,9 @@ struct fib_info *fib_create_info(struct fib_config *cfg)
 	fi->fib_nhs = nhs;
 	change_nexthops(fi) {
 		nexthop_nh->nh_parent = fi;
+		nexthop_nh->nh_pcpu_rth_output = alloc_percpu(struct rtable __rcu *);
+		if (!nexthop_nh->nh_pcpu_rth_output)
+			goto failure;
 	} endfor_nexthops(fi)
 
 	if (cfg->fc_mx) {
@@ -1055,6 +1085,7 @@ int fib_sync_down_dev(struct net_device *dev, int force)
 			else if (nexthop_nh->nh_dev == dev &&
 				 nexthop_nh->nh_scope != scope) {
 				nexthop_nh->nh_flags |= RTNH_F_DEAD;
+				fib_nh_flush_routes(nexthop_nh);
 #ifdef CONFIG_IP_ROUTE_MULTIPATH
 				spin_lock_bh(&fib_multipath_lock);
 				fi->fib_power -= nexthop_nh->nh_power;
@@ -67,6 +67,7 @@
 #include <net/ip.h>
 #include <net/protocol.h>
 #include <net/route.h>
+#include <net/ip_fib.h>
 #include <net/xfrm.h>
 #include <linux/skbuff.h>
 #include <net/sock.h>
@@ -794,6 +795,7 @@ static int __ip_append_data(struct sock *sk,
 {
 	struct inet_sock *inet = inet_sk(sk);
 	struct sk_buff *skb;
+	struct ubuf_info *uarg = NULL;
 
 	struct ip_options *opt = cork->opt;
 	int hh_len;
@@ -804,12 +806,16 @@ static int __ip_append_data(struct sock *sk,
 	int offset = 0;
 	unsigned int maxfraglen, fragheaderlen;
 	int csummode = CHECKSUM_NONE;
+	bool paged = false;
 	struct rtable *rt = (struct rtable *)cork->dst;
 
 	skb = skb_peek_tail(queue);
 
 	exthdrlen = !skb ? rt->dst.header_len : 0;
-	mtu = cork->fragsize;
+	/* A datagram that is segmented later only has to fit the IP
+	 * length field; udp_send_skb() checks the segment size.
+	 */
+	mtu = cork->gso_size ? IP_MAX_MTU : cork->fragsize;
 
 	hh_len = LL_RESERVED_SPACE(rt->dst.dev);
 
@@ -832,6 +838,22 @@ static int __ip_append_data(struct sock *sk,
 	    !exthdrlen)
 		csummode = CHECKSUM_PARTIAL;
 
+	if ((flags & MSG_ZEROCOPY) && length && sock_flag(sk, SOCK_ZEROCOPY)) {
+		uarg = sock_zerocopy_alloc(sk, length);
+		if (!uarg)
+			return -ENOBUFS;
+
+		/* User pages can only be sent as they are if the device
+		 * gathers them and computes the checksum, otherwise the
+		 * data is copied and the completion says so.
+		 */
+		if ((rt->dst.dev->features & NETIF_F_SG) &&
+		    csummode == CHECKSUM_PARTIAL)
+			paged = true;
+		else
+			uarg->zerocopy = 0;
+	}
+
 	cork->length += length;
 	if (((length > mtu) || (skb && skb_is_gso(skb))) &&
 	    (sk->sk_protocol == IPPROTO_UDP) &&
@@ -841,6 +863,7 @@ static int __ip_append_data(struct sock *sk,
 					 maxfraglen, flags);
 		if (err)
 			goto error;
+		sock_zerocopy_put(uarg);
 		return 0;
 	}
 
@@ -865,9 +888,11 @@ static int __ip_append_data(struct sock *sk,
 			unsigned int fraglen;
 			unsigned int fraggap;
 			unsigned int alloclen;
+			unsigned int pagedlen;
 			struct sk_buff *skb_prev;
 alloc_new_skb:
 			skb_prev = skb;
+			pagedlen = 0;
 			if (skb_prev)
 				fraggap = skb_prev->len - maxfraglen;
 			else
@@ -885,7 +910,15 @@ alloc_new_skb:
 			if ((flags & MSG_MORE) &&
 			    !(rt->dst.dev->features&NETIF_F_SG))
 				alloclen = mtu;
-			else
+			else if (paged || (cork->gso_size &&
+					    (rt->dst.dev->features & NETIF_F_SG))) {
+				/* Only the headers go in the linear part,
+				 * the payload is pinned or copied into
+				 * page fragments below.
+				 */
+				alloclen = fragheaderlen + transhdrlen;
+				pagedlen = datalen - transhdrlen;
+			} else
 				alloclen = fraglen;
 
 			alloclen += exthdrlen;
@@ -930,7 +963,7 @@ alloc_new_skb:
 			/*
 			 *	Find where to start putting bytes.
 			 */
-			data = skb_put(skb, fraglen + exthdrlen);
+			data = skb_put(skb, fraglen + exthdrlen - pagedlen);
 			skb_set_network_header(skb, exthdrlen);
 			skb->transport_header = (skb->network_header +
 						 fragheaderlen);
@@ -946,7 +979,7 @@ alloc_new_skb:
 				pskb_trim_unique(skb_prev, maxfraglen);
 			}
 
-			copy = datalen - transhdrlen - fraggap;
+			copy = datalen - transhdrlen - fraggap - pagedlen;
 			if (copy > 0 && getfrag(from, data + transhdrlen, offset, copy, fraggap, skb) < 0) {
 				err = -EFAULT;
 				kfree_skb(skb);
@@ -954,7 +987,7 @@ alloc_new_skb:
 			}
 
 			offset += copy;
-			length -= datalen - fraggap;
+			length -= datalen - fraggap - pagedlen;
 			transhdrlen = 0;
 			exthdrlen = 0;
 			csummode = CHECKSUM_NONE;
@@ -979,6 +1012,13 @@ alloc_new_skb:
 				err = -EFAULT;
 				goto error;
 			}
+		} else if (paged) {
+			err = skb_zerocopy_add_iovec(skb, from, offset, copy);
+			if (err < 0)
+				goto error;
+			copy = err;
+			skb_zcopy_set(skb, uarg);
+			atomic_add(copy, &sk->sk_wmem_alloc);
 		} else {
 			int i = skb_shinfo(skb)->nr_frags;
 			skb_frag_t *frag = &skb_shinfo(skb)->frags[i-1];
@@ -1031,9 +1071,11 @@ alloc_new_skb:
 		length -= copy;
 	}
 
+	sock_zerocopy_put(uarg);
 	return 0;
 
 error:
+	sock_zerocopy_put_abort(uarg);
 	cork->length -= length;
 	IP_INC_STATS(sock_net(sk), IPSTATS_MIB_OUTDISCARDS);
 	return err;
@@ -1075,6 +1117,8 @@ static int ip_setup_cork(struct sock *sk, struct inet_cork *cork,
 	cork->tx_flags = ipc->tx_flags;
 	cork->page = NULL;
 	cork->off = 0;
+	cork->gso_size = sk->sk_type == SOCK_DGRAM &&
+			 sk->sk_protocol == IPPROTO_UDP ? ipc->gso_size : 0;
 
 	return 0;
 }
@@ -1317,7 +1361,7 @@ struct sk_buff *__ip_make_skb(struct sock *sk,
 	 * If local_df is set too, we still allow to fragment this frame
 	 * locally. */
 	if (inet->pmtudisc >= IP_PMTUDISC_DO ||
-	    (skb->len <= dst_mtu(&rt->dst) &&
+	    ((skb->len <= dst_mtu(&rt->dst) || cork->gso_size) &&
 	     ip_dont_fragment(sk, &rt->dst)))
 		df = htons(IP_DF);
 
@@ -1472,9 +1516,18 @@ void ip_send_reply(struct sock *sk, struct sk_buff *skb, __be32 daddr,
 	struct ip_options_data replyopts;
 	struct ipcm_cookie ipc;
 	struct flowi4 fl4;
-	struct rtable *rt = skb_rtable(skb);
+	struct rtable *rt;
+	__be32 saddr;
+	int err;
 
-	if (ip_options_echo(&replyopts.opt.opt, skb))
+	/* Both may consult the FIB; resets can be sent from process
+	 * context through the socket backlog.
+	 */
+	rcu_read_lock();
+	err = ip_options_echo(&replyopts.opt.opt, skb);
+	saddr = fib_compute_spec_dst(skb);
+	rcu_read_unlock();
+	if (err)
 		return;
 
 	ipc.addr = daddr;
@@ -1492,7 +1545,7 @@ void ip_send_reply(struct sock *sk, struct sk_buff *skb, __be32 daddr,
 			   RT_TOS(arg->tos),
 			   RT_SCOPE_UNIVERSE, sk->sk_protocol,
 			   ip_reply_arg_flowi_flags(arg),
-			   daddr, rt->rt_spec_dst,
+			   daddr, saddr,
 			   tcp_hdr(skb)->source, tcp_hdr(skb)->dest);
 	security_skb_classify_flow(skb, flowi4_to_flowi(&fl4));
 	rt = ip_route_output_key(sock_net(sk), &fl4);
@@ -35,6 +35,7 @@
 #include <linux/mroute.h>
 #include <net/inet_ecn.h>
 #include <net/route.h>
+#include <net/ip_fib.h>
 #include <net/xfrm.h>
 #include <net/compat.h>
 #if defined(CONFIG_IPV6) || defined(CONFIG_IPV6_MODULE)
@@ -56,19 +57,15 @@
  *	SOL_IP control messages.
  */
 
+/* Filled in when the skb is queued, behind the IPCB still in use. */
+#define PKTINFO_SKB_CB(skb) ((struct in_pktinfo *)((skb)->cb +	\
+				sizeof((skb)->cb) - sizeof(struct in_pktinfo)))
+
 static void ip_cmsg_recv_pktinfo(struct msghdr *msg, struct sk_buff *skb)
 {
-	struct in_pktinfo info;
-	struct rtable *rt = skb_rtable(skb);
+	struct in_pktinfo info = *PKTINFO_SKB_CB(skb);
 
 	info.ipi_addr.s_addr = ip_hdr(skb)->daddr;
-	if (rt) {
-		info.ipi_ifindex = rt->rt_iif;
-		info.ipi_spec_dst.s_addr = rt->rt_spec_dst;
-	} else {
-		info.ipi_ifindex = 0;
-		info.ipi_spec_dst.s_addr = 0;
-	}
 
 	put_cmsg(msg, SOL_IP, IP_PKTINFO, sizeof(info), &info);
 }
@@ -407,8 +404,13 @@ int ip_recv_error(struct sock *sk, struct msghdr *msg, int len)
 	sin = (struct sockaddr_in *)msg->msg_name;
 	if (sin) {
 		sin->sin_family = AF_INET;
-		sin->sin_addr.s_addr = *(__be32 *)(skb_network_header(skb) +
-						   serr->addr_offset);
+		/* zerocopy completions carry no packet to take it from */
+		if (serr->ee.ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+			sin->sin_addr.s_addr = htonl(INADDR_ANY);
+		else
+			sin->sin_addr.s_addr =
+				*(__be32 *)(skb_network_header(skb) +
+					    serr->addr_offset);
 		sin->sin_port = serr->port;
 		memset(&sin->sin_zero, 0, sizeof(sin->sin_zero));
 	}
@@ -991,17 +993,40 @@ e_inval:
 	return -EINVAL;
 }
 
+/*
+ * Input routes no longer carry the specific destination, and the device
+ * is gone by the time recvmsg() runs, so IP_PKTINFO is worked out here.
+ */
+static void ipv4_pktinfo_prepare(struct sk_buff *skb)
+{
+	struct in_pktinfo *pktinfo = PKTINFO_SKB_CB(skb);
+
+	if (skb_rtable(skb)) {
+		rcu_read_lock();
+		pktinfo->ipi_ifindex = inet_iif(skb);
+		pktinfo->ipi_spec_dst.s_addr = fib_compute_spec_dst(skb);
+		rcu_read_unlock();
+	} else {
+		pktinfo->ipi_ifindex = 0;
+		pktinfo->ipi_spec_dst.s_addr = 0;
+	}
+}
+
 /**
  * ip_queue_rcv_skb - Queue an skb into sock receive queue
  * @sk: socket
  * @skb: buffer
  *
  * Queues an skb into socket receive queue. If IP_CMSG_PKTINFO option
- * is not set, we drop skb dst entry now, while dst cache line is hot.
+ * is set, the packet info is recorded first. Unless IP options may
+ * have to be echoed, we drop skb dst entry now, while dst cache line
+ * is hot.
  */
 int ip_queue_rcv_skb(struct sock *sk, struct sk_buff *skb)
 {
-	if (!(inet_sk(sk)->cmsg_flags & IP_CMSG_PKTINFO))
+	if (inet_sk(sk)->cmsg_flags & IP_CMSG_PKTINFO)
+		ipv4_pktinfo_prepare(skb);
+	if (!IPCB(skb)->opt.optlen)
 		skb_dst_drop(skb);
 	return sock_queue_rcv_skb(sk, skb);
 }
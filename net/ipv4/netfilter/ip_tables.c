@@ -17,6 +17,8 @@
 #include <linux/netdevice.h>
 #include <linux/module.h>
 #include <linux/icmp.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
 #include <net/ip.h>
 #include <net/compat.h>
 #include <asm/uaccess.h>
@@ -24,6 +26,7 @@
 #include <linux/proc_fs.h>
 #include <linux/err.h>
 #include <linux/cpumask.h>
+#include <linux/sort.h>
 
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
@@ -284,6 +287,133 @@ struct ipt_entry *ipt_next_entry(const struct ipt_entry *entry)
 	return (void *)entry + entry->next_offset;
 }
 
+#ifdef CONFIG_IP_NF_IPTABLES_CLASSIFY
+/*
+ * Rule set classifier.
+ *
+ * Large tables spend most of their time in ip_packet_match() on rules
+ * that cannot match.  At replace time every rule is reduced to the box of
+ * (saddr, daddr, protocol, sport, dport) values that can pass its address
+ * and protocol tests and, if its first match is "tcp" or "udp", its port
+ * ranges.  Everything else a rule looks at (interfaces, inversions, other
+ * matches) only shrinks the set of packets it matches, so the box is a
+ * superset.  The boxes are cut into a decision tree whose leaves list, in
+ * table order, the rules overlapping them.
+ *
+ * ipt_do_table() looks up the packet's leaf once and then jumps straight
+ * to the next listed rule instead of stepping through the entries in
+ * between: those would have failed ip_packet_match() or their port match,
+ * neither of which has side effects.  Listed rules are still evaluated in
+ * full.  Unconditional rules, chain policies and RETURNs included, are in
+ * every leaf, so the walk never leaves a chain early.
+ */
+enum {
+	IPT_CLS_SADDR,
+	IPT_CLS_DADDR,
+	IPT_CLS_PROTO,
+	IPT_CLS_SPORT,
+	IPT_CLS_DPORT,
+	IPT_CLS_DIMS
+};
+
+#define IPT_CLS_LEAF		IPT_CLS_DIMS	/* ->dim of leaf nodes */
+#define IPT_CLS_MIN_RULES	64	/* smaller tables are walked linearly */
+#define IPT_CLS_LEAF_RULES	8	/* don't split leaves this small */
+#define IPT_CLS_MAX_DEPTH	24
+#define IPT_CLS_MAX_COPIES	16	/* leaf entries per rule before giving up */
+#define IPT_CLS_SLOT_SHIFT	7	/* granularity of entry offset -> rule map */
+
+struct ipt_cls_node {
+	u32	dim;		/* dimension tested, IPT_CLS_LEAF for leaves */
+	u32	split;		/* keys up to and including split go left */
+	u32	index;		/* left child (right one follows) or first rule */
+	u32	count;		/* number of rules in a leaf */
+};
+
+struct ipt_cls {
+	unsigned int			nrules;
+	const struct ipt_cls_node	*nodes;		/* root first */
+	const u32			*rules;		/* leaf rule lists */
+	const u32			*offset;	/* rule -> entry offset */
+	const u32			*slot;		/* offset slot -> rule */
+};
+
+/* Returns false if the packet must be walked linearly */
+static bool
+ipt_cls_key(const struct sk_buff *skb, const struct iphdr *ip,
+	    const struct xt_action_param *par, u32 *key)
+{
+	union {
+		struct tcphdr	tcph;
+		struct udphdr	udph;
+	} _hdr;
+	const __be16 *ports;
+	unsigned int len;
+
+	/* Port matches fail on later fragments, tcp may even drop them */
+	if (par->fragoff != 0)
+		return false;
+
+	key[IPT_CLS_SADDR] = ntohl(ip->saddr);
+	key[IPT_CLS_DADDR] = ntohl(ip->daddr);
+	key[IPT_CLS_PROTO] = ip->protocol;
+	key[IPT_CLS_SPORT] = 0;
+	key[IPT_CLS_DPORT] = 0;
+
+	switch (ip->protocol) {
+	case IPPROTO_TCP:
+		len = sizeof(struct tcphdr);
+		break;
+	case IPPROTO_UDP:
+		len = sizeof(struct udphdr);
+		break;
+	default:
+		return true;
+	}
+
+	/* Truncated headers are dropped by the port matches themselves */
+	ports = skb_header_pointer(skb, par->thoff, len, &_hdr);
+	if (ports == NULL)
+		return false;
+	key[IPT_CLS_SPORT] = ntohs(ports[0]);
+	key[IPT_CLS_DPORT] = ntohs(ports[1]);
+	return true;
+}
+
+static inline const struct ipt_cls_node *
+ipt_cls_lookup(const struct ipt_cls *cls, const u32 *key)
+{
+	const struct ipt_cls_node *n = cls->nodes;
+
+	while (n->dim != IPT_CLS_LEAF)
+		n = &cls->nodes[n->index + (key[n->dim] > n->split)];
+	return n;
+}
+
+/* First rule at or after @e that the packet's leaf lists */
+static inline struct ipt_entry *
+ipt_cls_next(const struct ipt_cls *cls, const struct ipt_cls_node *leaf,
+	     const void *table_base, struct ipt_entry *e)
+{
+	const u32 *rules = cls->rules + leaf->index;
+	unsigned int lo = 0, hi = leaf->count;
+	u32 rule;
+
+	rule = cls->slot[((void *)e - table_base) >> IPT_CLS_SLOT_SHIFT];
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (rules[mid] < rule)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == leaf->count)
+		return e;
+	return get_entry(table_base, cls->offset[rules[lo]]);
+}
+#endif /* CONFIG_IP_NF_IPTABLES_CLASSIFY */
+
 /* Returns one of the generic firewall policies, like NF_ACCEPT. */
 unsigned int
 ipt_do_table(struct sk_buff *skb,
@@ -303,6 +433,11 @@ ipt_do_table(struct sk_buff *skb,
 	const struct xt_table_info *private;
 	struct xt_action_param acpar;
 	unsigned int addend;
+#ifdef CONFIG_IP_NF_IPTABLES_CLASSIFY
+	const struct ipt_cls_node *leaf = NULL;
+	const struct ipt_cls *cls;
+	u32 key[IPT_CLS_DIMS];
+#endif
 
 	/* Initialization */
 	ip = ip_hdr(skb);
@@ -333,6 +468,11 @@ ipt_do_table(struct sk_buff *skb,
 	origptr    = *stackptr;
 
 	e = get_entry(table_base, private->hook_entry[hook]);
+#ifdef CONFIG_IP_NF_IPTABLES_CLASSIFY
+	cls = private->classifier;
+	if (cls != NULL && ipt_cls_key(skb, ip, &acpar, key))
+		leaf = ipt_cls_lookup(cls, key);
+#endif
 
 	pr_debug("Entering %s(hook %u); sp at %u (UF %p)\n",
 		 table->name, hook, origptr,
@@ -343,6 +483,10 @@ ipt_do_table(struct sk_buff *skb,
 		const struct xt_entry_match *ematch;
 
 		IP_NF_ASSERT(e);
+#ifdef CONFIG_IP_NF_IPTABLES_CLASSIFY
+		if (leaf != NULL)
+			e = ipt_cls_next(cls, leaf, table_base, e);
+#endif
 		if (!ip_packet_match(ip, indev, outdev,
 		    &e->ip, acpar.fragoff)) {
  no_match:
@@ -414,11 +558,15 @@ ipt_do_table(struct sk_buff *skb,
 		verdict = t->u.kernel.target->target(skb, &acpar);
 		/* Target might have changed stuff. */
 		ip = ip_hdr(skb);
-		if (verdict == XT_CONTINUE)
-			e = ipt_next_entry(e);
-		else
+		if (verdict != XT_CONTINUE)
 			/* Verdict */
 			break;
+#ifdef CONFIG_IP_NF_IPTABLES_CLASSIFY
+		if (leaf != NULL)
+			leaf = ipt_cls_key(skb, ip, &acpar, key) ?
+			       ipt_cls_lookup(cls, key) : NULL;
+#endif
+		e = ipt_next_entry(e);
 	} while (!acpar.hotdrop);
 	pr_debug("Exiting %s; resetting sp from %u to %u\n",
 		 __func__, *stackptr, origptr);
@@ -783,6 +931,347 @@ cleanup_entry(struct ipt_entry *e, struct net *net)
 	module_put(par.target->me);
 }
 
+#ifdef CONFIG_IP_NF_IPTABLES_CLASSIFY
+struct ipt_cls_box {
+	u32	lo[IPT_CLS_DIMS];
+	u32	hi[IPT_CLS_DIMS];
+};
+
+/* Growable array used while compiling */
+struct ipt_cls_vec {
+	void		*data;
+	unsigned int	len;
+	unsigned int	max;
+	size_t		elem;
+};
+
+struct ipt_cls_build {
+	const struct ipt_cls_box	*box;
+	unsigned int			nrules;
+	struct ipt_cls_vec		nodes;
+	struct ipt_cls_vec		rules;		/* leaf lists */
+	struct ipt_cls_vec		stack;		/* lists being split */
+	u32				*points;
+};
+
+static int ipt_cls_vec_reserve(struct ipt_cls_vec *v, unsigned int n)
+{
+	unsigned int max;
+	void *data;
+
+	if (v->len + n <= v->max)
+		return 0;
+	max = max(v->max * 2, v->len + n);
+	data = vmalloc(max * v->elem);
+	if (data == NULL)
+		return -ENOMEM;
+	if (v->data != NULL) {
+		memcpy(data, v->data, v->len * v->elem);
+		vfree(v->data);
+	}
+	v->data = data;
+	v->max  = max;
+	return 0;
+}
+
+/* Address range passing a (non-inverted) prefix test */
+static void
+ipt_cls_addr(struct ipt_cls_box *box, int dim, __be32 addr, __be32 mask,
+	     bool inv)
+{
+	u32 m = ntohl(mask);
+
+	if (inv || (~m & (~m + 1)) != 0)
+		return;
+	box->lo[dim] = ntohl(addr) & m;
+	box->hi[dim] = box->lo[dim] | ~m;
+}
+
+static void
+ipt_cls_ports(struct ipt_cls_box *box, int dim, const u16 *pts, bool inv)
+{
+	if (inv || pts[0] > pts[1])
+		return;
+	box->lo[dim] = pts[0];
+	box->hi[dim] = pts[1];
+}
+
+static void ipt_cls_rule_box(const struct ipt_entry *e, struct ipt_cls_box *box)
+{
+	const struct ipt_ip *ip = &e->ip;
+	const struct xt_entry_match *m;
+	const char *name;
+	int d;
+
+	for (d = 0; d < IPT_CLS_DIMS; d++) {
+		box->lo[d] = 0;
+		box->hi[d] = ~0U;
+	}
+
+	ipt_cls_addr(box, IPT_CLS_SADDR, ip->src.s_addr, ip->smsk.s_addr,
+		     ip->invflags & IPT_INV_SRCIP);
+	ipt_cls_addr(box, IPT_CLS_DADDR, ip->dst.s_addr, ip->dmsk.s_addr,
+		     ip->invflags & IPT_INV_DSTIP);
+	if (ip->proto && !(ip->invflags & IPT_INV_PROTO))
+		box->lo[IPT_CLS_PROTO] = box->hi[IPT_CLS_PROTO] = ip->proto;
+
+	/*
+	 * Only the first match may be skipped: any later one runs after
+	 * matches that might keep state.
+	 */
+	if (e->target_offset == sizeof(struct ipt_entry))
+		return;
+	m = (const void *)e->elems;
+	name = m->u.kernel.match->name;
+	if (strcmp(name, "tcp") == 0) {
+		const struct xt_tcp *tcpinfo = (const void *)m->data;
+
+		ipt_cls_ports(box, IPT_CLS_SPORT, tcpinfo->spts,
+			      tcpinfo->invflags & XT_TCP_INV_SRCPT);
+		ipt_cls_ports(box, IPT_CLS_DPORT, tcpinfo->dpts,
+			      tcpinfo->invflags & XT_TCP_INV_DSTPT);
+	} else if (strcmp(name, "udp") == 0) {
+		const struct xt_udp *udpinfo = (const void *)m->data;
+
+		ipt_cls_ports(box, IPT_CLS_SPORT, udpinfo->spts,
+			      udpinfo->invflags & XT_UDP_INV_SRCPT);
+		ipt_cls_ports(box, IPT_CLS_DPORT, udpinfo->dpts,
+			      udpinfo->invflags & XT_UDP_INV_DSTPT);
+	}
+}
+
+static int ipt_cls_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Pick the cut that leaves the fewest rules on its larger side, trying
+ * the quartiles of the rule edges inside the region in every dimension.
+ * Returns false if no cut makes progress.
+ */
+static bool
+ipt_cls_choose(struct ipt_cls_build *b, const u32 *rules, unsigned int count,
+	       const u32 *lo, const u32 *hi, u32 *dim, u32 *split)
+{
+	unsigned int best = count, best_sum = 2 * count;
+	unsigned int d, i, q, n;
+
+	for (d = 0; d < IPT_CLS_DIMS; d++) {
+		if (lo[d] == hi[d])
+			continue;
+
+		n = 0;
+		for (i = 0; i < count; i++) {
+			const struct ipt_cls_box *box = &b->box[rules[i]];
+
+			if (box->lo[d] > lo[d])
+				b->points[n++] = box->lo[d] - 1;
+			if (box->hi[d] < hi[d])
+				b->points[n++] = box->hi[d];
+		}
+		if (n == 0)
+			continue;
+		sort(b->points, n, sizeof(u32), ipt_cls_cmp, NULL);
+
+		for (q = 1; q <= 3; q++) {
+			u32 t = b->points[n * q / 4];
+			unsigned int left = 0, right = 0;
+
+			for (i = 0; i < count; i++) {
+				const struct ipt_cls_box *box = &b->box[rules[i]];
+
+				left  += box->lo[d] <= t;
+				right += box->hi[d] > t;
+			}
+			if (max(left, right) < best ||
+			    (max(left, right) == best && left + right < best_sum)) {
+				best	 = max(left, right);
+				best_sum = left + right;
+				*dim	 = d;
+				*split	 = t;
+			}
+		}
+	}
+	return best < count;
+}
+
+/*
+ * Compile the @count rules at @first on the build stack, all overlapping
+ * the region [lo, hi], into @node.
+ */
+static int
+ipt_cls_split(struct ipt_cls_build *b, unsigned int node, unsigned int first,
+	      unsigned int count, u32 *lo, u32 *hi, unsigned int depth)
+{
+	struct ipt_cls_node *n;
+	unsigned int i, child, top;
+	u32 dim, split, save;
+	u32 *rules;
+	int ret;
+
+	if (count <= IPT_CLS_LEAF_RULES || depth == IPT_CLS_MAX_DEPTH ||
+	    !ipt_cls_choose(b, (u32 *)b->stack.data + first, count,
+			    lo, hi, &dim, &split)) {
+		if (b->rules.len + count > IPT_CLS_MAX_COPIES * b->nrules)
+			return -E2BIG;
+		ret = ipt_cls_vec_reserve(&b->rules, count);
+		if (ret < 0)
+			return ret;
+		memcpy((u32 *)b->rules.data + b->rules.len,
+		       (u32 *)b->stack.data + first, count * sizeof(u32));
+
+		n = (struct ipt_cls_node *)b->nodes.data + node;
+		n->dim   = IPT_CLS_LEAF;
+		n->split = 0;
+		n->index = b->rules.len;
+		n->count = count;
+		b->rules.len += count;
+		return 0;
+	}
+
+	ret = ipt_cls_vec_reserve(&b->nodes, 2);
+	if (ret < 0)
+		return ret;
+	child = b->nodes.len;
+	b->nodes.len += 2;
+	n = (struct ipt_cls_node *)b->nodes.data + node;
+	n->dim   = dim;
+	n->split = split;
+	n->index = child;
+
+	/* Both halves go on top of the stack in turn, which may move it */
+	top = b->stack.len;
+	ret = ipt_cls_vec_reserve(&b->stack, count);
+	if (ret < 0)
+		return ret;
+	rules = b->stack.data;
+	for (i = 0; i < count; i++)
+		if (b->box[rules[first + i]].lo[dim] <= split)
+			rules[b->stack.len++] = rules[first + i];
+	save = hi[dim];
+	hi[dim] = split;
+	ret = ipt_cls_split(b, child, top, b->stack.len - top, lo, hi,
+			    depth + 1);
+	hi[dim] = save;
+	b->stack.len = top;
+	if (ret < 0)
+		return ret;
+
+	rules = b->stack.data;
+	for (i = 0; i < count; i++)
+		if (b->box[rules[first + i]].hi[dim] > split)
+			rules[b->stack.len++] = rules[first + i];
+	save = lo[dim];
+	lo[dim] = split + 1;
+	ret = ipt_cls_split(b, child + 1, top, b->stack.len - top, lo, hi,
+			    depth + 1);
+	lo[dim] = save;
+	b->stack.len = top;
+	return ret;
+}
+
+/*
+ * Build the classifier of a checked table.  This is only an accelerator,
+ * so on failure the table is simply walked linearly.
+ */
+static void ipt_cls_compile(struct xt_table_info *newinfo, void *entry0)
+{
+	unsigned int nrules = newinfo->number;
+	unsigned int nslots = (newinfo->size >> IPT_CLS_SLOT_SHIFT) + 1;
+	u32 lo[IPT_CLS_DIMS], hi[IPT_CLS_DIMS];
+	struct ipt_cls_build b = {
+		.nrules	= nrules,
+		.nodes	= { .elem = sizeof(struct ipt_cls_node) },
+		.rules	= { .elem = sizeof(u32) },
+		.stack	= { .elem = sizeof(u32) },
+	};
+	struct ipt_cls_box *box = NULL;
+	const struct ipt_entry *iter;
+	struct ipt_cls *cls;
+	u32 *offset, *slot;
+	unsigned int i;
+	size_t size;
+	void *p;
+
+	/* Distinct entries must fall into distinct offset slots */
+	BUILD_BUG_ON(sizeof(struct ipt_entry) + sizeof(struct xt_entry_target) <
+		     1 << IPT_CLS_SLOT_SHIFT);
+
+	if (nrules < IPT_CLS_MIN_RULES)
+		return;
+
+	box = vmalloc(nrules * sizeof(*box));
+	b.points = vmalloc(2 * nrules * sizeof(u32));
+	if (box == NULL || b.points == NULL ||
+	    ipt_cls_vec_reserve(&b.nodes, nrules) < 0 ||
+	    ipt_cls_vec_reserve(&b.rules, 2 * nrules) < 0 ||
+	    ipt_cls_vec_reserve(&b.stack, 2 * nrules) < 0)
+		goto out;
+	b.box = box;
+
+	i = 0;
+	xt_entry_foreach(iter, entry0, newinfo->size) {
+		ipt_cls_rule_box(iter, &box[i]);
+		((u32 *)b.stack.data)[i] = i;
+		i++;
+	}
+	b.stack.len = nrules;
+
+	for (i = 0; i < IPT_CLS_DIMS; i++) {
+		lo[i] = 0;
+		hi[i] = ~0U;
+	}
+	b.nodes.len = 1;
+	if (ipt_cls_split(&b, 0, 0, nrules, lo, hi, 0) < 0) {
+		duprintf("ipt_cls_compile: falling back to linear walk\n");
+		goto out;
+	}
+
+	size = sizeof(*cls) + b.nodes.len * sizeof(struct ipt_cls_node) +
+	       (b.rules.len + nrules + nslots) * sizeof(u32);
+	cls = vmalloc(size);
+	if (cls == NULL)
+		goto out;
+
+	p = cls + 1;
+	memcpy(p, b.nodes.data, b.nodes.len * sizeof(struct ipt_cls_node));
+	cls->nodes = p;
+	p += b.nodes.len * sizeof(struct ipt_cls_node);
+	memcpy(p, b.rules.data, b.rules.len * sizeof(u32));
+	cls->rules = p;
+	p += b.rules.len * sizeof(u32);
+	offset = p;
+	slot = offset + nrules;
+
+	i = 0;
+	xt_entry_foreach(iter, entry0, newinfo->size) {
+		offset[i] = (const void *)iter - entry0;
+		slot[offset[i] >> IPT_CLS_SLOT_SHIFT] = i;
+		i++;
+	}
+	cls->offset = offset;
+	cls->slot   = slot;
+	cls->nrules = nrules;
+
+	duprintf("ipt_cls_compile: %u rules, %u nodes, %u leaf entries\n",
+		 nrules, b.nodes.len, b.rules.len);
+	newinfo->classifier = cls;
+out:
+	vfree(b.stack.data);
+	vfree(b.rules.data);
+	vfree(b.nodes.data);
+	vfree(b.points);
+	vfree(box);
+}
+#else
+static inline void ipt_cls_compile(struct xt_table_info *newinfo, void *entry0)
+{
+}
+#endif /* CONFIG_IP_NF_IPTABLES_CLASSIFY */
+
 /* Checks and translates the user-supplied table segment (held in
    newinfo) */
 static int
@@ -863,6 +1352,8 @@ translate_table(struct net *net, struct xt_table_info *newinfo, void *entry0,
 		return ret;
 	}
 
+	ipt_cls_compile(newinfo, entry0);
+
 	/* And one copy for every other CPU */
 	for_each_possible_cpu(i) {
 		if (newinfo->entries[i] && newinfo->entries[i] != entry0)
@@ -1762,6 +2253,8 @@ translate_compat_table(struct net *net,
 		return ret;
 	}
 
+	ipt_cls_compile(newinfo, entry1);
+
 	/* And one copy for every other CPU */
 	for_each_possible_cpu(i)
 		if (newinfo->entries[i] && newinfo->entries[i] != entry1)
@@ -0,0 +1,90 @@
+/*
+ * TCP Fast Open: cookie generation on the server side and the per
+ * destination cookie cache on the client side.
+ */
+
+#include <linux/kernel.h>
+#include <linux/seqlock.h>
+#include <linux/string.h>
+#include <net/inetpeer.h>
+#include <net/secure_seq.h>
+#include <net/tcp.h>
+
+int sysctl_tcp_fastopen __read_mostly = TFO_CLIENT_ENABLE;
+
+/* Computes the fastopen cookie for the peer. The cookie is a MAC of
+ * the IP addresses keyed by the same secret used for initial sequence
+ * numbers, so it can be regenerated and checked on every SYN without
+ * keeping any per-client state on the server.
+ */
+void tcp_fastopen_cookie_gen(__be32 saddr, __be32 daddr,
+			     struct tcp_fastopen_cookie *foc)
+{
+	u64 mac = secure_tcp_fastopen_cookie(saddr, daddr);
+
+	BUILD_BUG_ON(sizeof(mac) != TCP_FASTOPEN_COOKIE_SIZE);
+	memcpy(foc->val, &mac, TCP_FASTOPEN_COOKIE_SIZE);
+	foc->len = TCP_FASTOPEN_COOKIE_SIZE;
+}
+
+/* The client remembers the cookie, the MSS and recent SYN losses of
+ * each server in the inet_peer entry of its address. Readers run
+ * locklessly against the seqlock.
+ */
+static DEFINE_SEQLOCK(fastopen_seqlock);
+
+void tcp_fastopen_cache_get(struct sock *sk, u16 *mss,
+			    struct tcp_fastopen_cookie *cookie,
+			    int *syn_loss, unsigned long *last_syn_loss)
+{
+	struct inet_peer *peer;
+	bool release_it;
+	unsigned int seq;
+
+	cookie->len = 0;
+	*syn_loss = 0;
+
+	peer = inet_csk(sk)->icsk_af_ops->get_peer(sk, &release_it);
+	if (!peer)
+		return;
+
+	do {
+		seq = read_seqbegin(&fastopen_seqlock);
+		if (peer->tfo_mss)
+			*mss = peer->tfo_mss;
+		cookie->len = peer->tfo_cookie_len;
+		memcpy(cookie->val, peer->tfo_cookie, cookie->len);
+		*syn_loss = peer->tfo_syn_loss;
+		*last_syn_loss = *syn_loss ? peer->tfo_last_syn_loss : 0;
+	} while (read_seqretry(&fastopen_seqlock, seq));
+
+	if (release_it)
+		inet_putpeer(peer);
+}
+
+void tcp_fastopen_cache_set(struct sock *sk, u16 mss,
+			    struct tcp_fastopen_cookie *cookie, bool syn_lost)
+{
+	struct inet_peer *peer;
+	bool release_it;
+
+	peer = inet_csk(sk)->icsk_af_ops->get_peer(sk, &release_it);
+	if (!peer)
+		return;
+
+	write_seqlock_bh(&fastopen_seqlock);
+	peer->tfo_mss = mss;
+	if (cookie->len > 0) {
+		peer->tfo_cookie_len = cookie->len;
+		memcpy(peer->tfo_cookie, cookie->val, cookie->len);
+	}
+	if (syn_lost) {
+		peer->tfo_syn_loss++;
+		peer->tfo_last_syn_loss = jiffies;
+	} else
+		peer->tfo_syn_loss = 0;
+	write_sequnlock_bh(&fastopen_seqlock);
+
+	if (release_it)
+		inet_putpeer(peer);
+}
@@ -96,6 +96,7 @@
 #include <linux/inet.h>
 #include <linux/netdevice.h>
 #include <linux/slab.h>
+#include <linux/jump_label.h>
 #include <net/tcp_states.h>
 #include <linux/skbuff.h>
 #include <linux/proc_fs.h>
@@ -105,9 +106,13 @@
 #include <net/route.h>
 #include <net/checksum.h>
 #include <net/xfrm.h>
+#include <net/busy_poll.h>
 #include <trace/events/udp.h>
 #include "udp_impl.h"
 
+/* Only look up sockets from GRO while some socket has UDP_GRO set */
+static struct jump_label_key udp_gro_needed;
+
 struct udp_table udp_table __read_mostly;
 EXPORT_SYMBOL(udp_table);
 
@@ -136,12 +141,15 @@ static int udp_lib_lport_inuse(struct net *net, __u16 num,
 {
 	struct sock *sk2;
 	struct hlist_nulls_node *node;
+	uid_t uid = sock_i_uid(sk);
 
 	sk_nulls_for_each(sk2, node, &hslot->head)
 		if (net_eq(sock_net(sk2), net) &&
 		    sk2 != sk &&
 		    (bitmap || udp_sk(sk2)->udp_port_hash == num) &&
 		    (!sk2->sk_reuse || !sk->sk_reuse) &&
+		    (!sk2->sk_reuseport || !sk->sk_reuseport ||
+		     uid != sock_i_uid(sk2)) &&
 		    (!sk2->sk_bound_dev_if || !sk->sk_bound_dev_if ||
 		     sk2->sk_bound_dev_if == sk->sk_bound_dev_if) &&
 		    (*saddr_comp)(sk, sk2)) {
@@ -166,6 +174,7 @@ static int udp_lib_lport_inuse2(struct net *net, __u16 num,
 {
 	struct sock *sk2;
 	struct hlist_nulls_node *node;
+	uid_t uid = sock_i_uid(sk);
 	int res = 0;
 
 	spin_lock(&hslot2->lock);
@@ -174,6 +183,8 @@ static int udp_lib_lport_inuse2(struct net *net, __u16 num,
 		    sk2 != sk &&
 		    (udp_sk(sk2)->udp_port_hash == num) &&
 		    (!sk2->sk_reuse || !sk->sk_reuse) &&
+		    (!sk2->sk_reuseport || !sk->sk_reuseport ||
+		     uid != sock_i_uid(sk2)) &&
 		    (!sk2->sk_bound_dev_if || !sk->sk_bound_dev_if ||
 		     sk2->sk_bound_dev_if == sk->sk_bound_dev_if) &&
 		    (*saddr_comp)(sk, sk2)) {
@@ -406,7 +417,8 @@ static struct sock *udp4_lib_lookup2(struct net *net,
 {
 	struct sock *sk, *result;
 	struct hlist_nulls_node *node;
-	int score, badness;
+	int score, badness, matches = 0, reuseport = 0;
+	u32 hash = 0;
 
 begin:
 	result = NULL;
@@ -417,8 +429,18 @@ begin:
 		if (score > badness) {
 			result = sk;
 			badness = score;
-			if (score == SCORE2_MAX)
+			reuseport = sk->sk_reuseport;
+			if (reuseport) {
+				hash = inet_ehashfn(net, daddr, hnum,
+						    saddr, sport);
+				matches = 1;
+			} else if (score == SCORE2_MAX)
 				goto exact_match;
+		} else if (score == badness && reuseport) {
+			matches++;
+			if (((u64)hash * matches) >> 32 == 0)
+				result = sk;
+			hash = next_pseudo_random32(hash);
 		}
 	}
 	/*
@@ -454,7 +476,8 @@ static struct sock *__udp4_lib_lookup(struct net *net, __be32 saddr,
 	unsigned short hnum = ntohs(dport);
 	unsigned int hash2, slot2, slot = udp_hashfn(net, hnum, udptable->mask);
 	struct udp_hslot *hslot2, *hslot = &udptable->hash[slot];
-	int score, badness;
+	int score, badness, matches = 0, reuseport = 0;
+	u32 hash = 0;
 
 	rcu_read_lock();
 	if (hslot->count > 10) {
@@ -490,6 +513,21 @@ begin:
 		if (score > badness) {
 			result = sk;
 			badness = score;
+			reuseport = sk->sk_reuseport;
+			if (reuseport) {
+				hash = inet_ehashfn(net, daddr, hnum,
+						    saddr, sport);
+				matches = 1;
+			}
+		} else if (score == badness && reuseport) {
+			/*
+			 * Spread datagrams over the SO_REUSEPORT group by
+			 * flow hash; see __inet_lookup_listener().
+			 */
+			matches++;
+			if (((u64)hash * matches) >> 32 == 0)
+				result = sk;
+			hash = next_pseudo_random32(hash);
 		}
 	}
 	/*
@@ -707,7 +745,8 @@ static void udp4_hwcsum(struct sk_buff *skb, __be32 src, __be32 dst)
 	}
 }
 
-static int udp_send_skb(struct sk_buff *skb, struct flowi4 *fl4)
+static int udp_send_skb(struct sk_buff *skb, struct flowi4 *fl4,
+			unsigned int gso_size)
 {
 	struct sock *sk = skb->sk;
 	struct inet_sock *inet = inet_sk(sk);
@@ -727,6 +766,37 @@ static int udp_send_skb(struct sk_buff *skb, struct flowi4 *fl4)
 	uh->len = htons(len);
 	uh->check = 0;
 
+	if (gso_size) {
+		const int hlen = skb_network_header_len(skb) +
+				 sizeof(struct udphdr);
+		unsigned int mtu = inet->pmtudisc == IP_PMTUDISC_PROBE ?
+				   skb_dst(skb)->dev->mtu :
+				   dst_mtu(skb_dst(skb));
+
+		if (hlen + gso_size > mtu ||
+		    skb->len - hlen > gso_size * UDP_MAX_SEGMENTS ||
+		    sk->sk_no_check == UDP_CSUM_NOXMIT) {
+			kfree_skb(skb);
+			return -EINVAL;
+		}
+		/* Every segment gets a checksum of its own, so leave
+		 * only the pseudo header in the UDP header here.
+		 */
+		if (skb->ip_summed != CHECKSUM_PARTIAL || is_udplite ||
+		    skb_dst(skb)->header_len) {
+			kfree_skb(skb);
+			return -EIO;
+		}
+
+		if (len - sizeof(struct udphdr) > gso_size) {
+			skb_shinfo(skb)->gso_size = gso_size;
+			skb_shinfo(skb)->gso_type = SKB_GSO_UDP_L4;
+			skb_shinfo(skb)->gso_segs = DIV_ROUND_UP(len -
+						sizeof(struct udphdr), gso_size);
+		}
+		goto csum_partial;
+	}
+
 	if (is_udplite)  				 /*     UDP-Lite      */
 		csum = udplite_csum(skb);
 
@@ -736,7 +806,7 @@ static int udp_send_skb(struct sk_buff *skb, struct flowi4 *fl4)
 		goto send;
 
 	} else if (skb->ip_summed == CHECKSUM_PARTIAL) { /* UDP hardware csum */
-
+csum_partial:
 		udp4_hwcsum(skb, fl4->saddr, fl4->daddr);
 		goto send;
 
@@ -771,6 +841,7 @@ static int udp_push_pending_frames(struct sock *sk)
 	struct udp_sock  *up = udp_sk(sk);
 	struct inet_sock *inet = inet_sk(sk);
 	struct flowi4 *fl4 = &inet->cork.fl.u.ip4;
+	unsigned int gso_size = inet->cork.base.gso_size;
 	struct sk_buff *skb;
 	int err = 0;
 
@@ -778,7 +849,7 @@ static int udp_push_pending_frames(struct sock *sk)
 	if (!skb)
 		goto out;
 
-	err = udp_send_skb(skb, fl4);
+	err = udp_send_skb(skb, fl4, gso_size);
 
 out:
 	up->len = 0;
@@ -786,6 +857,32 @@ out:
 	return err;
 }
 
+/*
+ * Per-call override of UDP_SEGMENT. The IP level messages are left to
+ * ip_cmsg_send().
+ */
+static int udp_cmsg_send(struct msghdr *msg, u16 *gso_size)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (!CMSG_OK(msg, cmsg))
+			return -EINVAL;
+		if (cmsg->cmsg_level != SOL_UDP)
+			continue;
+		switch (cmsg->cmsg_type) {
+		case UDP_SEGMENT:
+			if (cmsg->cmsg_len != CMSG_LEN(sizeof(__u16)))
+				return -EINVAL;
+			*gso_size = *(__u16 *)CMSG_DATA(cmsg);
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
 int udp_sendmsg(struct kiocb *iocb, struct sock *sk, struct msghdr *msg,
 		size_t len)
 {
@@ -819,6 +916,7 @@ int udp_sendmsg(struct kiocb *iocb, struct sock *sk, struct msghdr *msg,
 
 	ipc.opt = NULL;
 	ipc.tx_flags = 0;
+	ipc.gso_size = up->gso_size;
 
 	getfrag = is_udplite ? udplite_getfrag : ip_generic_getfrag;
 
@@ -873,6 +971,9 @@ int udp_sendmsg(struct kiocb *iocb, struct sock *sk, struct msghdr *msg,
 	if (err)
 		return err;
 	if (msg->msg_controllen) {
+		err = udp_cmsg_send(msg, &ipc.gso_size);
+		if (err)
+			return err;
 		err = ip_cmsg_send(sock_net(sk), msg, &ipc);
 		if (err)
 			return err;
@@ -963,7 +1064,7 @@ back_from_confirm:
 				  msg->msg_flags);
 		err = PTR_ERR(skb);
 		if (skb && !IS_ERR(skb))
-			err = udp_send_skb(skb, fl4);
+			err = udp_send_skb(skb, fl4, ipc.gso_size);
 		goto out;
 	}
 
@@ -1163,6 +1264,7 @@ int udp_recvmsg(struct kiocb *iocb, struct sock *sk, struct msghdr *msg,
 {
 	struct inet_sock *inet = inet_sk(sk);
 	struct sockaddr_in *sin = (struct sockaddr_in *)msg->msg_name;
+	struct skb_batch *batch = sock_iocb_batch(iocb);
 	struct sk_buff *skb;
 	unsigned int ulen, copied;
 	int peeked;
@@ -1180,8 +1282,9 @@ int udp_recvmsg(struct kiocb *iocb, struct sock *sk, struct msghdr *msg,
 		return ip_recv_error(sk, msg, len);
 
 try_again:
-	skb = __skb_recv_datagram(sk, flags | (noblock ? MSG_DONTWAIT : 0),
-				  &peeked, &err);
+	skb = skb_recv_datagram_batch(sk, batch,
+				      flags | (noblock ? MSG_DONTWAIT : 0),
+				      &peeked, &err);
 	if (!skb)
 		goto out;
 
@@ -1233,13 +1336,18 @@ try_again:
 	}
 	if (inet->cmsg_flags)
 		ip_cmsg_recv(msg, skb);
+	if (udp_sk(sk)->gro_enabled && skb_is_gso(skb)) {
+		int gso_size = skb_shinfo(skb)->gso_size;
+
+		put_cmsg(msg, SOL_UDP, UDP_GRO, sizeof(gso_size), &gso_size);
+	}
 
 	err = copied;
 	if (flags & MSG_TRUNC)
 		err = ulen;
 
 out_free:
-	skb_free_datagram_locked(sk, skb);
+	skb_free_datagram_batch(sk, batch, skb);
 out:
 	return err;
 
@@ -1358,6 +1466,8 @@ static int __udp_queue_rcv_skb(struct sock *sk, struct sk_buff *skb)
 	if (inet_sk(sk)->inet_daddr)
 		sock_rps_save_rxhash(sk, skb);
 
+	sk_mark_napi_id(sk, skb);
+
 	rc = ip_queue_rcv_skb(sk, skb);
 	if (rc < 0) {
 		int is_udplite = IS_UDPLITE(sk);
@@ -1384,7 +1494,7 @@ static int __udp_queue_rcv_skb(struct sock *sk, struct sk_buff *skb)
  * Note that in the success and error cases, the skb is assumed to
  * have either been requeued or freed.
  */
-int udp_queue_rcv_skb(struct sock *sk, struct sk_buff *skb)
+static int udp_queue_rcv_one_skb(struct sock *sk, struct sk_buff *skb)
 {
 	struct udp_sock *up = udp_sk(sk);
 	int rc;
@@ -1492,6 +1602,47 @@ drop:
 	return -1;
 }
 
+/*
+ * Split a merged datagram train back into its datagrams, for a socket
+ * that did not ask for UDP_GRO.
+ */
+static struct sk_buff *udp_rcv_segment(struct sock *sk, struct sk_buff *skb)
+{
+	struct sk_buff *segs;
+
+	__skb_push(skb, skb->data - skb_mac_header(skb));
+	segs = skb_gso_segment(skb, NETIF_F_SG | NETIF_F_HW_CSUM);
+	if (unlikely(IS_ERR_OR_NULL(segs))) {
+		UDP_INC_STATS_BH(sock_net(sk), UDP_MIB_INERRORS,
+				 IS_UDPLITE(sk));
+		atomic_inc(&sk->sk_drops);
+		kfree_skb(skb);
+		return NULL;
+	}
+
+	consume_skb(skb);
+	return segs;
+}
+
+int udp_queue_rcv_skb(struct sock *sk, struct sk_buff *skb)
+{
+	struct sk_buff *segs, *next;
+
+	if (likely(!skb_is_gso(skb) || udp_sk(sk)->gro_enabled))
+		return udp_queue_rcv_one_skb(sk, skb);
+
+	segs = udp_rcv_segment(sk, skb);
+	for (skb = segs; skb; skb = next) {
+		next = skb->next;
+		skb->next = NULL;
+		__skb_pull(skb, skb_transport_offset(skb));
+		/* A single segment cannot be resubmitted */
+		if (udp_queue_rcv_one_skb(sk, skb) > 0)
+			kfree_skb(skb);
+	}
+	return segs ? 0 : -1;
+}
+
 
 static void flush_stack(struct sock **stack, unsigned int count,
 			struct sk_buff *skb, unsigned int final)
@@ -1723,6 +1874,8 @@ void udp_destroy_sock(struct sock *sk)
 	bool slow = lock_sock_fast(sk);
 	udp_flush_pending_frames(sk);
 	unlock_sock_fast(sk, slow);
+	if (udp_sk(sk)->gro_enabled)
+		jump_label_dec(&udp_gro_needed);
 }
 
 /*
@@ -1771,6 +1924,27 @@ int udp_lib_setsockopt(struct sock *sk, int level, int optname,
 		}
 		break;
 
+	/* Segmentation and receive offload are IPv4 only for now */
+	case UDP_SEGMENT:
+		if (sk->sk_family != AF_INET)
+			return -ENOPROTOOPT;
+		if (val < 0 || val > USHRT_MAX)
+			return -EINVAL;
+		up->gso_size = val;
+		break;
+
+	case UDP_GRO:
+		if (sk->sk_family != AF_INET || is_udplite)
+			return -ENOPROTOOPT;
+		lock_sock(sk);
+		if (val && !up->gro_enabled)
+			jump_label_inc(&udp_gro_needed);
+		else if (!val && up->gro_enabled)
+			jump_label_dec(&udp_gro_needed);
+		up->gro_enabled = !!val;
+		release_sock(sk);
+		break;
+
 	/*
 	 * 	UDP-Lite's partial checksum coverage (RFC 3828).
 	 */
@@ -1853,6 +2027,14 @@ int udp_lib_getsockopt(struct sock *sk, int level, int optname,
 		val = up->encap_type;
 		break;
 
+	case UDP_SEGMENT:
+		val = up->gso_size;
+		break;
+
+	case UDP_GRO:
+		val = up->gro_enabled;
+		break;
+
 	/* The following two cannot be changed on UDP sockets, the return is
 	 * always 0 (which corresponds to the full checksum coverage of UDP). */
 	case UDPLITE_SEND_CSCOV:
@@ -2247,6 +2429,77 @@ int udp4_ufo_send_check(struct sk_buff *skb)
 	return 0;
 }
 
+/*
+ * The UDP header of a datagram to be segmented carries the pseudo header
+ * sum over the length of the whole datagram; move it to @newlen.
+ */
+static __sum16 udp_gso_pseudo_len(__sum16 check, __be16 oldlen,
+				  __be16 newlen)
+{
+	__sum16 sum = ~check;
+
+	csum_replace2(&sum, oldlen, newlen);
+	return ~sum;
+}
+
+/*
+ * Split a datagram sent with UDP_SEGMENT into datagrams of gso_size
+ * payload each, the last one possibly shorter. Unlike UFO every segment
+ * is a datagram of its own with a UDP header and checksum.
+ */
+static struct sk_buff *__udp_gso_segment(struct sk_buff *gso_skb,
+					 u32 features)
+{
+	struct sk_buff *segs, *seg;
+	struct udphdr *uh;
+	unsigned int mss;
+	__be16 oldlen;
+	__sum16 check;
+
+	mss = skb_shinfo(gso_skb)->gso_size;
+	if (unlikely(gso_skb->len <= sizeof(*uh) + mss))
+		return ERR_PTR(-EINVAL);
+
+	if (skb_gso_ok(gso_skb, features | NETIF_F_GSO_ROBUST)) {
+		/* Packet is from an untrusted source, reset gso_segs. */
+		skb_shinfo(gso_skb)->gso_segs = DIV_ROUND_UP(gso_skb->len -
+							     sizeof(*uh), mss);
+		return NULL;
+	}
+
+	if (unlikely(!pskb_may_pull(gso_skb, sizeof(*uh))))
+		return ERR_PTR(-EINVAL);
+
+	uh = udp_hdr(gso_skb);
+	oldlen = uh->len;
+	check = uh->check;
+
+	__skb_pull(gso_skb, sizeof(*uh));
+	segs = skb_segment(gso_skb, features);
+	if (unlikely(IS_ERR_OR_NULL(segs)))
+		return segs;
+
+	for (seg = segs; seg; seg = seg->next) {
+		__be16 newlen = htons(seg->len - skb_transport_offset(seg));
+
+		uh = udp_hdr(seg);
+		uh->len = newlen;
+		uh->check = udp_gso_pseudo_len(check, oldlen, newlen);
+
+		/* Without checksum offload skb_segment() has summed the
+		 * payload into seg->csum; add the header to finish it.
+		 */
+		if (seg->ip_summed != CHECKSUM_PARTIAL) {
+			uh->check = csum_fold(csum_partial(uh, sizeof(*uh),
+							   seg->csum));
+			if (uh->check == 0)
+				uh->check = CSUM_MANGLED_0;
+		}
+	}
+
+	return segs;
+}
+
 struct sk_buff *udp4_ufo_fragment(struct sk_buff *skb, u32 features)
 {
 	struct sk_buff *segs = ERR_PTR(-EINVAL);
@@ -2254,6 +2507,9 @@ struct sk_buff *udp4_ufo_fragment(struct sk_buff *skb, u32 features)
 	int offset;
 	__wsum csum;
 
+	if (skb_shinfo(skb)->gso_type & SKB_GSO_UDP_L4)
+		return __udp_gso_segment(skb, features);
+
 	mss = skb_shinfo(skb)->gso_size;
 	if (unlikely(skb->len <= mss))
 		goto out;
@@ -2289,3 +2545,125 @@ out:
 	return segs;
 }
 
+/*
+ * Merge consecutive datagrams of a flow whose socket has set UDP_GRO.
+ * All datagrams of a train have the size of the first one, except for
+ * the last which may be shorter; that size becomes the gso_size of the
+ * merged skb.
+ */
+struct sk_buff **udp4_gro_receive(struct sk_buff **head, struct sk_buff *skb)
+{
+	const struct iphdr *iph = skb_gro_network_header(skb);
+	struct sk_buff **pp = NULL;
+	struct udphdr *uh, *uh2;
+	struct sk_buff *p;
+	unsigned int hlen, off, len, mss;
+	struct sock *sk;
+	int flush = 1;
+	bool gro, wildcard;
+
+	if (!static_branch(&udp_gro_needed) || ipv4_is_multicast(iph->daddr))
+		goto out;
+
+	/* Bridges, macvlan and macvtap hand the packet on before it ever
+	 * reaches our sockets: never merge anything for them.
+	 */
+	if (rcu_access_pointer(skb->dev->rx_handler))
+		goto out;
+
+	off = skb_gro_offset(skb);
+	hlen = off + sizeof(*uh);
+	uh = skb_gro_header_fast(skb, off);
+	if (skb_gro_header_hard(skb, hlen)) {
+		uh = skb_gro_header_slow(skb, hlen, off);
+		if (unlikely(!uh))
+			goto out;
+	}
+
+	sk = __udp4_lib_lookup(dev_net(skb->dev), iph->saddr, uh->source,
+			       iph->daddr, uh->dest, skb->dev->ifindex,
+			       &udp_table);
+	if (!sk)
+		goto out;
+	gro = udp_sk(sk)->gro_enabled;
+	wildcard = !inet_sk(sk)->inet_rcv_saddr;
+	sock_put(sk);
+	if (!gro)
+		goto out;
+
+	/* A wildcard-bound socket matches whatever the destination, so
+	 * make sure the datagram is really for us and not to be forwarded.
+	 */
+	if (wildcard &&
+	    inet_addr_type(dev_net(skb->dev), iph->daddr) != RTN_LOCAL)
+		goto out;
+
+	/* A datagram without checksum leaves nothing to verify the merged
+	 * one against.
+	 */
+	if (!uh->check || ntohs(uh->len) != skb_gro_len(skb))
+		goto out;
+
+	switch (skb->ip_summed) {
+	case CHECKSUM_COMPLETE:
+		if (csum_tcpudp_magic(iph->saddr, iph->daddr, skb_gro_len(skb),
+				      IPPROTO_UDP, skb->csum))
+			goto out;
+		skb->ip_summed = CHECKSUM_UNNECESSARY;
+		break;
+	case CHECKSUM_NONE:
+		goto out;
+	}
+
+	skb_gro_pull(skb, sizeof(*uh));
+	len = skb_gro_len(skb);
+	flush = 0;
+
+	for (; (p = *head); head = &p->next) {
+		if (!NAPI_GRO_CB(p)->same_flow)
+			continue;
+
+		uh2 = udp_hdr(p);
+		if (*(u32 *)&uh->source ^ *(u32 *)&uh2->source) {
+			NAPI_GRO_CB(p)->same_flow = 0;
+			continue;
+		}
+
+		/* A larger datagram starts a new train, a shorter one is
+		 * merged and ends the current one.
+		 */
+		mss = skb_shinfo(p)->gso_size;
+		if (NAPI_GRO_CB(p)->flush || len > mss ||
+		    skb_gro_receive(head, skb)) {
+			pp = head;
+			goto out;
+		}
+
+		if (len < mss || NAPI_GRO_CB(*head)->count >= UDP_MAX_SEGMENTS)
+			pp = head;
+		goto out;
+	}
+
+out:
+	NAPI_GRO_CB(skb)->flush |= flush;
+	return pp;
+}
+
+int udp4_gro_complete(struct sk_buff *skb)
+{
+	const struct iphdr *iph = ip_hdr(skb);
+	struct udphdr *uh = udp_hdr(skb);
+	unsigned int len = skb->len - skb_transport_offset(skb);
+
+	uh->len = htons(len);
+	uh->check = ~csum_tcpudp_magic(iph->saddr, iph->daddr, len,
+				       IPPROTO_UDP, 0);
+	skb->csum_start = skb_transport_header(skb) - skb->head;
+	skb->csum_offset = offsetof(struct udphdr, check);
+	skb->ip_summed = CHECKSUM_PARTIAL;
+
+	skb_shinfo(skb)->gso_type = SKB_GSO_UDP_L4;
+	skb_shinfo(skb)->gso_segs = NAPI_GRO_CB(skb)->count;
+	return 0;
+}
+
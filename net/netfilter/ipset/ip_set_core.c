@@ -205,6 +205,8 @@ unlock:
 	ip_set_type_unlock();
 
 	synchronize_rcu();
+	/* Set elements freed by call_rcu_bh() from the type module */
+	rcu_barrier_bh();
 }
 EXPORT_SYMBOL_GPL(ip_set_type_unregister);
 
@@ -341,9 +343,15 @@ ip_set_test(ip_set_id_t index, const struct sk_buff *skb,
 	    !(opt->family == set->family || set->family == AF_UNSPEC))
 		return 0;
 
-	read_lock_bh(&set->lock);
-	ret = set->variant->kadt(set, skb, par, IPSET_TEST, opt);
-	read_unlock_bh(&set->lock);
+	if (set->variant->rcu_test) {
+		rcu_read_lock_bh();
+		ret = set->variant->kadt(set, skb, par, IPSET_TEST, opt);
+		rcu_read_unlock_bh();
+	} else {
+		read_lock_bh(&set->lock);
+		ret = set->variant->kadt(set, skb, par, IPSET_TEST, opt);
+		read_unlock_bh(&set->lock);
+	}
 
 	if (ret == -EAGAIN) {
 		/* Type requests element to be completed */
@@ -496,7 +496,7 @@ hash_ipportip_create(struct ip_set *set, struct nlattr *tb[], u32 flags)
 	hbits = htable_bits(hashsize);
 	h->table = ip_set_alloc(
 			sizeof(struct htable)
-			+ jhash_size(hbits) * sizeof(struct hbucket));
+			+ jhash_size(hbits) * sizeof(struct hbucket *));
 	if (!h->table) {
 		kfree(h);
 		return -ENOMEM;
@@ -217,6 +217,8 @@ struct tpacket_kbdq_core {
 #define PGV_FROM_VMALLOC 1
 struct pgv {
 	char *buffer;
+	/* TPACKET_V3 tx: skbs still referencing this block */
+	atomic_t pending;
 };
 
 struct packet_ring_buffer {
@@ -232,6 +234,10 @@ struct packet_ring_buffer {
 
 	struct tpacket_kbdq_core	prb_bdqc;
 	atomic_t		pending;
+
+	/* TPACKET_V3 tx: next frame and frames left in the head block */
+	unsigned int		tx_blk_off;
+	unsigned int		tx_blk_pkts;
 };
 
 #define BLOCK_STATUS(x)	((x)->hdr.bh1.block_status)
@@ -244,6 +250,8 @@ struct packet_ring_buffer {
 
 struct packet_sock;
 static int tpacket_snd(struct packet_sock *po, struct msghdr *msg);
+static int tpacket_snd_blocks(struct packet_sock *po, struct msghdr *msg,
+		struct net_device *dev, __be16 proto, unsigned char *addr);
 
 static void *packet_previous_frame(struct packet_sock *po,
 		struct packet_ring_buffer *rb,
@@ -295,6 +303,7 @@ struct packet_sock {
 	unsigned int		tp_reserve;
 	unsigned int		tp_loss:1;
 	unsigned int		tp_tstamp;
+	int			(*xmit)(struct sk_buff *skb);
 	struct packet_type	prot_hook ____cacheline_aligned_in_smp;
 };
 
@@ -484,6 +493,57 @@ static void *packet_current_frame(struct packet_sock *po,
 	return packet_lookup_frame(po, rb, rb->head, status);
 }
 
+static void __packet_set_block_status(struct tpacket_block_desc *pbd,
+		int status)
+{
+	BLOCK_STATUS(pbd) = status;
+	flush_dcache_page(pgv_to_page(&BLOCK_STATUS(pbd)));
+	smp_wmb();
+}
+
+static int __packet_get_block_status(struct tpacket_block_desc *pbd)
+{
+	smp_rmb();
+	flush_dcache_page(pgv_to_page(&BLOCK_STATUS(pbd)));
+	return BLOCK_STATUS(pbd);
+}
+
+/*
+ * TPACKET_V3 tx ring: rb->head indexes blocks rather than frames.
+ * User space hands a whole block over by setting its block_status to
+ * TP_STATUS_SEND_REQUEST; the kernel marks it TP_STATUS_SENDING while
+ * frames from it are in flight and gives it back as TP_STATUS_AVAILABLE
+ * once the last skb referencing it has been destructed.
+ */
+static void *packet_current_tx_block(struct packet_sock *po,
+		struct packet_ring_buffer *rb,
+		int status)
+{
+	struct tpacket_block_desc *pbd;
+
+	pbd = (struct tpacket_block_desc *)rb->pg_vec[rb->head].buffer;
+	if (status != __packet_get_block_status(pbd))
+		return NULL;
+	return pbd;
+}
+
+static void *packet_current_tx_frame(struct packet_sock *po,
+		struct packet_ring_buffer *rb,
+		int status)
+{
+	if (po->tp_version <= TPACKET_V2)
+		return packet_current_frame(po, rb, status);
+
+	return packet_current_tx_block(po, rb, status);
+}
+
+static void packet_put_tx_block(struct pgv *pgv)
+{
+	if (atomic_dec_and_test(&pgv->pending))
+		__packet_set_block_status((struct tpacket_block_desc *)
+					  pgv->buffer, TP_STATUS_AVAILABLE);
+}
+
 static void prb_del_retire_blk_timer(struct tpacket_kbdq_core *pkc)
 {
 	del_timer_sync(&pkc->retire_blk_timer);
@@ -1924,12 +1984,72 @@ ring_is_full:
 	goto drop_n_restore;
 }
 
+static void packet_pick_tx_queue(struct net_device *dev, struct sk_buff *skb)
+{
+	skb_set_queue_mapping(skb, raw_smp_processor_id() %
+				   dev->real_num_tx_queues);
+}
+
+/*
+ * Hand the skb straight to the driver, bypassing the qdisc layer.  Only
+ * skbs that need no help from the stack take this path; anything that
+ * still wants segmentation, checksumming or a software vlan tag goes
+ * through dev_queue_xmit() as usual.  A busy queue drops the skb.
+ */
+static int packet_direct_xmit(struct sk_buff *skb)
+{
+	struct net_device *dev = skb->dev;
+	const struct net_device_ops *ops = dev->netdev_ops;
+	struct netdev_queue *txq;
+	u32 features;
+	int ret;
+
+	if (unlikely(!netif_running(dev) || !netif_carrier_ok(dev))) {
+		kfree_skb(skb);
+		return NET_XMIT_DROP;
+	}
+
+	features = netif_skb_features(skb);
+	if (netif_needs_gso(skb, features) || vlan_tx_tag_present(skb) ||
+	    (skb->ip_summed == CHECKSUM_PARTIAL &&
+	     !(features & NETIF_F_ALL_CSUM)))
+		return dev_queue_xmit(skb);
+
+	if (skb_needs_linearize(skb, features) && __skb_linearize(skb)) {
+		kfree_skb(skb);
+		return NET_XMIT_DROP;
+	}
+
+	packet_pick_tx_queue(dev, skb);
+	txq = netdev_get_tx_queue(dev, skb_get_queue_mapping(skb));
+
+	__netif_tx_lock_bh(txq);
+	if (unlikely(netif_tx_queue_frozen_or_stopped(txq))) {
+		ret = NETDEV_TX_BUSY;
+		kfree_skb(skb);
+		goto out;
+	}
+
+	ret = ops->ndo_start_xmit(skb, dev);
+	if (likely(dev_xmit_complete(ret)))
+		txq_trans_update(txq);
+	else
+		kfree_skb(skb);
+out:
+	__netif_tx_unlock_bh(txq);
+	return ret;
+}
+
 static void tpacket_destruct_skb(struct sk_buff *skb)
 {
 	struct packet_sock *po = pkt_sk(skb->sk);
 	void *ph;
 
-	if (likely(po->tx_ring.pg_vec)) {
+	if (likely(po->tx_ring.pg_vec) && po->tp_version == TPACKET_V3) {
+		BUG_ON(atomic_read(&po->tx_ring.pending) == 0);
+		atomic_dec(&po->tx_ring.pending);
+		packet_put_tx_block(skb_shinfo(skb)->destructor_arg);
+	} else if (likely(po->tx_ring.pg_vec)) {
 		ph = skb_shinfo(skb)->destructor_arg;
 		BUG_ON(__packet_get_status(po, ph) != TP_STATUS_SENDING);
 		BUG_ON(atomic_read(&po->tx_ring.pending) == 0);
@@ -1947,6 +2067,7 @@ static int tpacket_fill_skb(struct packet_sock *po, struct sk_buff *skb,
 	union {
 		struct tpacket_hdr *h1;
 		struct tpacket2_hdr *h2;
+		struct tpacket3_hdr *h3;
 		void *raw;
 	} ph;
 	int to_write, offset, len, tp_len, nr_frags, len_max;
@@ -1961,9 +2082,11 @@ static int tpacket_fill_skb(struct packet_sock *po, struct sk_buff *skb,
 	skb->dev = dev;
 	skb->priority = po->sk.sk_priority;
 	skb->mark = po->sk.sk_mark;
-	skb_shinfo(skb)->destructor_arg = ph.raw;
 
 	switch (po->tp_version) {
+	case TPACKET_V3:
+		tp_len = ph.h3->tp_len;
+		break;
 	case TPACKET_V2:
 		tp_len = ph.h2->tp_len;
 		break;
@@ -1971,7 +2094,7 @@ static int tpacket_fill_skb(struct packet_sock *po, struct sk_buff *skb,
 		tp_len = ph.h1->tp_len;
 		break;
 	}
-	if (unlikely(tp_len > size_max)) {
+	if (unlikely(tp_len < 0 || tp_len > size_max)) {
 		pr_err("packet size is too long (%d > %d)\n", tp_len, size_max);
 		return -EMSGSIZE;
 	}
@@ -2038,6 +2161,122 @@ static int tpacket_fill_skb(struct packet_sock *po, struct sk_buff *skb,
 	return tp_len;
 }
 
+/*
+ * Transmit from a TPACKET_V3 ring.  Each block holds a variable number of
+ * variable length frames, chained through tp_next_offset and starting at
+ * offset_to_first_pkt.  All blocks handed over with TP_STATUS_SEND_REQUEST
+ * are drained by a single send().  If transmission stops part way through
+ * a block (no memory, busy queue), the position is kept in the ring and
+ * the next send() resumes from there.
+ */
+static int tpacket_snd_blocks(struct packet_sock *po, struct msghdr *msg,
+		struct net_device *dev, __be16 proto, unsigned char *addr)
+{
+	struct packet_ring_buffer *rb = &po->tx_ring;
+	unsigned int blk_size = rb->pg_vec_pages << PAGE_SHIFT;
+	int mtu_max = dev->mtu + dev->hard_header_len;
+	struct tpacket_block_desc *pbd;
+	struct tpacket3_hdr *ppd;
+	struct sk_buff *skb;
+	struct pgv *pgv;
+	unsigned int off;
+	int tp_len, size_max, len_sum = 0, err = 0;
+
+	do {
+		pgv = &rb->pg_vec[rb->head];
+		pbd = (struct tpacket_block_desc *)pgv->buffer;
+
+		if (!rb->tx_blk_pkts) {
+			pbd = packet_current_tx_block(po, rb,
+					TP_STATUS_SEND_REQUEST);
+			if (unlikely(pbd == NULL)) {
+				schedule();
+				continue;
+			}
+			/* Pinned until every frame in it has been queued */
+			atomic_set(&pgv->pending, 1);
+			rb->tx_blk_off = BLOCK_O2FP(pbd);
+			rb->tx_blk_pkts = BLOCK_NUM_PKTS(pbd);
+			__packet_set_block_status(pbd, TP_STATUS_SENDING);
+		}
+
+		while (rb->tx_blk_pkts) {
+			off = rb->tx_blk_off;
+			ppd = NULL;
+			err = -EINVAL;
+			if (unlikely(off < sizeof(*pbd) ||
+				     off & (TPACKET_ALIGNMENT - 1) ||
+				     off > blk_size - po->tp_hdrlen))
+				goto bad_frame;
+
+			ppd = (struct tpacket3_hdr *)((char *)pbd + off);
+			if (unlikely(rb->tx_blk_pkts > 1 &&
+				     ppd->tp_next_offset < po->tp_hdrlen))
+				goto bad_frame;
+
+			size_max = blk_size -
+				(off + po->tp_hdrlen - sizeof(struct sockaddr_ll));
+			if (size_max > mtu_max)
+				size_max = mtu_max;
+
+			skb = sock_alloc_send_skb(&po->sk,
+					LL_ALLOCATED_SPACE(dev)
+					+ sizeof(struct sockaddr_ll),
+					0, &err);
+			if (unlikely(skb == NULL))
+				goto out;
+
+			tp_len = tpacket_fill_skb(po, skb, ppd, dev, size_max,
+					proto, addr);
+			if (unlikely(tp_len < 0)) {
+				kfree_skb(skb);
+				if (!po->tp_loss) {
+					err = tp_len;
+					goto bad_frame;
+				}
+				goto next_frame;
+			}
+
+			skb->destructor = tpacket_destruct_skb;
+			skb_shinfo(skb)->destructor_arg = pgv;
+			atomic_inc(&pgv->pending);
+			atomic_inc(&rb->pending);
+
+			err = po->xmit(skb);
+			if (unlikely(err > 0)) {
+				err = net_xmit_errno(err);
+				/* Dropped: leave the frame for the next send() */
+				if (err)
+					goto out;
+			}
+			len_sum += tp_len;
+next_frame:
+			rb->tx_blk_off = off + ppd->tp_next_offset;
+			rb->tx_blk_pkts--;
+		}
+
+		packet_put_tx_block(pgv);
+		packet_increment_head(rb);
+	} while (likely((pbd != NULL) ||
+			((!(msg->msg_flags & MSG_DONTWAIT)) &&
+			 (atomic_read(&rb->pending))))
+		);
+
+	return len_sum;
+
+bad_frame:
+	if (ppd) {
+		ppd->tp_status = TP_STATUS_WRONG_FORMAT;
+		flush_dcache_page(pgv_to_page(&ppd->tp_status));
+	}
+	/* The rest of the block is discarded */
+	rb->tx_blk_pkts = 0;
+	packet_put_tx_block(pgv);
+	packet_increment_head(rb);
+out:
+	return err;
+}
+
 static int tpacket_snd(struct packet_sock *po, struct msghdr *msg)
 {
 	struct sk_buff *skb;
@@ -2083,6 +2322,11 @@ static int tpacket_snd(struct packet_sock *po, struct msghdr *msg)
 	if (unlikely(!(dev->flags & IFF_UP)))
 		goto out_put;
 
+	if (po->tp_version == TPACKET_V3) {
+		err = tpacket_snd_blocks(po, msg, dev, proto, addr);
+		goto out_put;
+	}
+
 	size_max = po->tx_ring.frame_size
 		- (po->tp_hdrlen - sizeof(struct sockaddr_ll));
 
@@ -2125,11 +2369,12 @@ static int tpacket_snd(struct packet_sock *po, struct msghdr *msg)
 		}
 
 		skb->destructor = tpacket_destruct_skb;
+		skb_shinfo(skb)->destructor_arg = ph;
 		__packet_set_status(po, ph, TP_STATUS_SENDING);
 		atomic_inc(&po->tx_ring.pending);
 
 		status = TP_STATUS_SEND_REQUEST;
-		err = dev_queue_xmit(skb);
+		err = po->xmit(skb);
 		if (unlikely(err > 0)) {
 			err = net_xmit_errno(err);
 			if (err && __packet_get_status(po, ph) ==
@@ -2352,7 +2597,7 @@ static int packet_snd(struct socket *sock,
 	 *	Now send it
 	 */
 
-	err = dev_queue_xmit(skb);
+	err = po->xmit(skb);
 	if (err > 0 && (err = net_xmit_errno(err)) != 0)
 		goto out_unlock;
 
@@ -2589,6 +2834,7 @@ static int packet_create(struct net *net, struct socket *sock, int protocol,
 
 	spin_lock_init(&po->bind_lock);
 	mutex_init(&po->pg_vec_lock);
+	po->xmit = dev_queue_xmit;
 	po->prot_hook.func = packet_rcv;
 
 	if (sock->type == SOCK_PACKET)
@@ -2727,7 +2973,8 @@ static int packet_recvmsg(struct kiocb *iocb, struct socket *sock,
 				vnet_hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
 			else if (sinfo->gso_type & SKB_GSO_UDP)
 				vnet_hdr.gso_type = VIRTIO_NET_HDR_GSO_UDP;
-			else if (sinfo->gso_type & SKB_GSO_FCOE)
+			else if (sinfo->gso_type & (SKB_GSO_FCOE |
+						     SKB_GSO_UDP_L4))
 				goto out_free;
 			else
 				BUG();
@@ -3187,6 +3434,18 @@ packet_setsockopt(struct socket *sock, int level, int optname, char __user *optv
 
 		return fanout_add(sk, val & 0xffff, val >> 16);
 	}
+	case PACKET_QDISC_BYPASS:
+	{
+		int val;
+
+		if (optlen != sizeof(val))
+			return -EINVAL;
+		if (copy_from_user(&val, optval, sizeof(val)))
+			return -EFAULT;
+
+		po->xmit = val ? packet_direct_xmit : dev_queue_xmit;
+		return 0;
+	}
 	default:
 		return -ENOPROTOOPT;
 	}
@@ -3310,6 +3569,12 @@ static int packet_getsockopt(struct socket *sock, int level, int optname,
 		       0);
 		data = &val;
 		break;
+	case PACKET_QDISC_BYPASS:
+		if (len > sizeof(int))
+			len = sizeof(int);
+		val = po->xmit == packet_direct_xmit;
+		data = &val;
+		break;
 	default:
 		return -ENOPROTOOPT;
 	}
@@ -3441,7 +3706,8 @@ static unsigned int packet_poll(struct file *file, struct socket *sock,
 	spin_unlock_bh(&sk->sk_receive_queue.lock);
 	spin_lock_bh(&sk->sk_write_queue.lock);
 	if (po->tx_ring.pg_vec) {
-		if (packet_current_frame(po, &po->tx_ring, TP_STATUS_AVAILABLE))
+		if (packet_current_tx_frame(po, &po->tx_ring,
+					    TP_STATUS_AVAILABLE))
 			mask |= POLLOUT | POLLWRNORM;
 	}
 	spin_unlock_bh(&sk->sk_write_queue.lock);
@@ -3567,12 +3833,6 @@ static int packet_set_ring(struct sock *sk, union tpacket_req_u *req_u,
 	/* Added to avoid minimal code churn */
 	struct tpacket_req *req = &req_u->req;
 
-	/* Opening a Tx-ring is NOT supported in TPACKET_V3 */
-	if (!closing && tx_ring && (po->tp_version > TPACKET_V2)) {
-		WARN(1, "Tx-ring is not supported.\n");
-		goto out;
-	}
-
 	rb = tx_ring ? &po->tx_ring : &po->rx_ring;
 	rb_queue = tx_ring ? &sk->sk_write_queue : &sk->sk_receive_queue;
 
@@ -3627,12 +3887,12 @@ static int packet_set_ring(struct sock *sk, union tpacket_req_u *req_u,
 			goto out;
 		switch (po->tp_version) {
 		case TPACKET_V3:
-		/* Transmit path is not supported. We checked
-		 * it above but just being paranoid
-		 */
+			/* The tx ring is walked block by block in
+			 * tpacket_snd_blocks() and needs no block core.
+			 */
 			if (!tx_ring)
 				init_prb_bdqc(po, rb, pg_vec, req_u, tx_ring);
-				break;
+			break;
 		default:
 			break;
 		}
@@ -3664,8 +3924,12 @@ static int packet_set_ring(struct sock *sk, union tpacket_req_u *req_u,
 		err = 0;
 		spin_lock_bh(&rb_queue->lock);
 		swap(rb->pg_vec, pg_vec);
-		rb->frame_max = (req->tp_frame_nr - 1);
+		if (tx_ring && po->tp_version == TPACKET_V3)
+			rb->frame_max = (req->tp_block_nr - 1);
+		else
+			rb->frame_max = (req->tp_frame_nr - 1);
 		rb->head = 0;
+		rb->tx_blk_pkts = 0;
 		rb->frame_size = req->tp_frame_size;
 		spin_unlock_bh(&rb_queue->lock);
 
@@ -3689,7 +3953,7 @@ static int packet_set_ring(struct sock *sk, union tpacket_req_u *req_u,
 	}
 	spin_unlock(&po->bind_lock);
 	if (closing && (po->tp_version > TPACKET_V2)) {
-		/* Because we don't support block-based V3 on tx-ring */
+		/* The block-based tx ring has no retire timer */
 		if (!tx_ring)
 			prb_shutdown_retire_blk_timer(po, tx_ring, rb_queue);
 	}
@@ -97,6 +97,7 @@
 #include <net/cls_cgroup.h>
 
 #include <net/sock.h>
+#include <net/busy_poll.h>
 #include <linux/netfilter.h>
 
 #include <linux/if_tun.h>
@@ -398,7 +399,7 @@ int sock_map_fd(struct socket *sock, int flags)
 }
 EXPORT_SYMBOL(sock_map_fd);
 
-static struct socket *sock_from_file(struct file *file, int *err)
+struct socket *sock_from_file(struct file *file, int *err)
 {
 	if (file->f_op == &socket_file_ops)
 		return file->private_data;	/* set in sock_map_fd */
@@ -406,6 +407,7 @@ static struct socket *sock_from_file(struct file *file, int *err)
 	*err = -ENOTSOCK;
 	return NULL;
 }
+EXPORT_SYMBOL(sock_from_file);
 
 /**
  *	sockfd_lookup - Go from a file number to its socket slot
@@ -723,6 +725,7 @@ int sock_recvmsg(struct socket *sock, struct msghdr *msg,
 
 	init_sync_kiocb(&iocb, NULL);
 	iocb.private = &siocb;
+	siocb.batch = NULL;
 	ret = __sock_recvmsg(&iocb, sock, msg, size, flags);
 	if (-EIOCBQUEUED == ret)
 		ret = wait_on_sync_kiocb(&iocb);
@@ -730,8 +733,9 @@ int sock_recvmsg(struct socket *sock, struct msghdr *msg,
 }
 EXPORT_SYMBOL(sock_recvmsg);
 
-static int sock_recvmsg_nosec(struct socket *sock, struct msghdr *msg,
-			      size_t size, int flags)
+static int sock_recvmsg_batch(struct socket *sock, struct msghdr *msg,
+			      size_t size, int flags, int nosec,
+			      struct skb_batch *batch)
 {
 	struct kiocb iocb;
 	struct sock_iocb siocb;
@@ -739,7 +743,11 @@ static int sock_recvmsg_nosec(struct socket *sock, struct msghdr *msg,
 
 	init_sync_kiocb(&iocb, NULL);
 	iocb.private = &siocb;
-	ret = __sock_recvmsg_nosec(&iocb, sock, msg, size, flags);
+	siocb.batch = batch;
+	if (nosec)
+		ret = __sock_recvmsg_nosec(&iocb, sock, msg, size, flags);
+	else
+		ret = __sock_recvmsg(&iocb, sock, msg, size, flags);
 	if (-EIOCBQUEUED == ret)
 		ret = wait_on_sync_kiocb(&iocb);
 	return ret;
@@ -823,6 +831,7 @@ static struct sock_iocb *alloc_sock_iocb(struct kiocb *iocb,
 	}
 
 	siocb->kiocb = iocb;
+	siocb->batch = NULL;
 	iocb->private = siocb;
 	return siocb;
 }
@@ -1074,13 +1083,24 @@ EXPORT_SYMBOL(sock_create_lite);
 /* No kernel lock held - perfect */
 static unsigned int sock_poll(struct file *file, poll_table *wait)
 {
+	unsigned int busy_flag = 0;
 	struct socket *sock;
 
 	/*
 	 *      We can't return errors to poll, so it's either yes or no.
 	 */
 	sock = file->private_data;
-	return sock->ops->poll(file, sock, wait);
+
+	if (sock->sk && sk_can_busy_loop(sock->sk)) {
+		/* this socket can busy poll, so tell the system call */
+		busy_flag = POLL_BUSY_LOOP;
+
+		/* once, only if requested by the syscall */
+		if (wait && (wait->key & POLL_BUSY_LOOP))
+			sk_busy_loop(sock->sk, 1);
+	}
+
+	return busy_flag | sock->ops->poll(file, sock, wait);
 }
 
 static int sock_mmap(struct file *file, struct vm_area_struct *vma)
@@ -2080,7 +2100,8 @@ SYSCALL_DEFINE4(sendmmsg, int, fd, struct mmsghdr __user *, mmsg,
 }
 
 static int __sys_recvmsg(struct socket *sock, struct msghdr __user *msg,
-			 struct msghdr *msg_sys, unsigned flags, int nosec)
+			 struct msghdr *msg_sys, unsigned flags, int nosec,
+			 struct skb_batch *batch)
 {
 	struct compat_msghdr __user *msg_compat =
 	    (struct compat_msghdr __user *)msg;
@@ -2139,8 +2160,7 @@ static int __sys_recvmsg(struct socket *sock, struct msghdr __user *msg,
 
 	if (sock->file->f_flags & O_NONBLOCK)
 		flags |= MSG_DONTWAIT;
-	err = (nosec ? sock_recvmsg_nosec : sock_recvmsg)(sock, msg_sys,
-							  total_len, flags);
+	err = sock_recvmsg_batch(sock, msg_sys, total_len, flags, nosec, batch);
 	if (err < 0)
 		goto out_freeiov;
 	len = err;
@@ -2187,7 +2207,7 @@ SYSCALL_DEFINE3(recvmsg, int, fd, struct msghdr __user *, msg,
 	if (!sock)
 		goto out;
 
-	err = __sys_recvmsg(sock, msg, &msg_sys, flags, 0);
+	err = __sys_recvmsg(sock, msg, &msg_sys, flags, 0, NULL);
 
 	fput_light(sock->file, fput_needed);
 out:
@@ -2207,6 +2227,7 @@ int __sys_recvmmsg(int fd, struct mmsghdr __user *mmsg, unsigned int vlen,
 	struct compat_mmsghdr __user *compat_entry;
 	struct msghdr msg_sys;
 	struct timespec end_time;
+	struct skb_batch batch;
 
 	if (timeout &&
 	    poll_select_set_timeout(&end_time, timeout->tv_sec,
@@ -2225,6 +2246,14 @@ int __sys_recvmmsg(int fd, struct mmsghdr __user *mmsg, unsigned int vlen,
 
 	entry = mmsg;
 	compat_entry = (struct compat_mmsghdr __user *)mmsg;
+	/*
+	 * Let the protocol dequeue up to vlen datagrams in one go: the one
+	 * it returns plus at most vlen - 1 parked on the batch.  Parked
+	 * datagrams are invisible to other readers and to poll() until we
+	 * return; the ones we do not get to are put back at the head of
+	 * the receive queue, ahead of anything that arrived meanwhile.
+	 */
+	skb_batch_init(&batch, vlen ? vlen - 1 : 0);
 
 	while (datagrams < vlen) {
 		/*
@@ -2233,7 +2262,7 @@ int __sys_recvmmsg(int fd, struct mmsghdr __user *mmsg, unsigned int vlen,
 		if (MSG_CMSG_COMPAT & flags) {
 			err = __sys_recvmsg(sock, (struct msghdr __user *)compat_entry,
 					    &msg_sys, flags & ~MSG_WAITFORONE,
-					    datagrams);
+					    datagrams, &batch);
 			if (err < 0)
 				break;
 			err = __put_user(err, &compat_entry->msg_len);
@@ -2241,7 +2270,7 @@ int __sys_recvmmsg(int fd, struct mmsghdr __user *mmsg, unsigned int vlen,
 		} else {
 			err = __sys_recvmsg(sock, (struct msghdr __user *)entry,
 					    &msg_sys, flags & ~MSG_WAITFORONE,
-					    datagrams);
+					    datagrams, &batch);
 			if (err < 0)
 				break;
 			err = put_user(err, &entry->msg_len);
@@ -2274,6 +2303,7 @@ int __sys_recvmmsg(int fd, struct mmsghdr __user *mmsg, unsigned int vlen,
 			break;
 	}
 
+	skb_batch_release(sock->sk, &batch);
 out_put:
 	fput_light(sock->file, fput_needed);
 